@@ -0,0 +1,453 @@
+#include "backend.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string_view>
+#include <syncstream>
+
+#include <iconv.h>
+#if WITH_ICU_BACKEND
+#include <unicode/ucnv.h>
+#include <unicode/ucnv_err.h>
+#endif
+
+namespace
+{
+class native_conversion_t : public conversion_t
+{
+public:
+    explicit native_conversion_t(std::unique_ptr<native::converter_t> converter)
+        : converter_(std::move(converter))
+    {
+    }
+    size_t convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) override
+    {
+        // the native charsets have no shift states
+        if (inbuf == nullptr || *inbuf == nullptr) {
+            return 0;
+        }
+        return converter_->convert(inbuf, inbytesleft, outbuf, outbytesleft);
+    }
+
+private:
+    std::unique_ptr<native::converter_t> converter_;
+};
+
+class native_backend_t : public conversion_backend_t
+{
+public:
+    const char *name() const override
+    {
+        return "native";
+    }
+    std::unique_ptr<conversion_t> open(const std::string &to_encoding, const std::string &from_encoding, native::unmappable_t unmappable) const override
+    {
+        auto converter = native::converter_t::open(to_encoding, from_encoding, unmappable);
+        if (!converter) {
+            return nullptr;
+        }
+        return std::make_unique<native_conversion_t>(std::move(converter));
+    }
+};
+
+class iconv_conversion_t : public conversion_t
+{
+public:
+    iconv_conversion_t(iconv_t cd, const std::string &to_encoding, const std::string &from_encoding, native::unmappable_t unmappable)
+        : cd_(cd)
+    {
+        if (unmappable == native::unmappable_t::fail) {
+            return;
+        }
+        // iconv reports characters missing from the output encoding as EILSEQ, just like invalid input.
+        // Tell them apart by decoding the offending character on its own, then skip or substitute it.
+        probe_ = iconv_open("UTF-32LE", from_encoding.c_str());
+        if (unmappable == native::unmappable_t::substitute) {
+            iconv_t sub = iconv_open(to_encoding.c_str(), "ASCII");
+            if (sub != (iconv_t)-1) {
+                char question[] = "?";
+                char *in_ptr = question;
+                size_t in_left = 1;
+                char buf[16];
+                char *out_ptr = buf;
+                size_t out_left = sizeof(buf);
+                if (iconv(sub, &in_ptr, &in_left, &out_ptr, &out_left) != (size_t)-1) {
+                    substitute_.assign(buf, out_ptr);
+                }
+                iconv_close(sub);
+            }
+        }
+    }
+    ~iconv_conversion_t() override
+    {
+        if (probe_ != (iconv_t)-1) {
+            iconv_close(probe_);
+        }
+        iconv_close(cd_);
+    }
+
+    size_t convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) override
+    {
+        while (true) {
+            const size_t result = iconv(cd_, inbuf, inbytesleft, outbuf, outbytesleft);
+            if (result != (size_t)-1 || errno != EILSEQ || !handle_unmappable(inbuf, inbytesleft, outbuf, outbytesleft)) {
+                return result;
+            }
+        }
+    }
+
+private:
+    // true if the character at `in` was valid input and has been skipped or substituted
+    bool handle_unmappable(char **in, size_t *in_left, char **out, size_t *out_left)
+    {
+        if (probe_ == (iconv_t)-1) {
+            return false;
+        }
+        iconv(probe_, nullptr, nullptr, nullptr, nullptr);
+        char *probe_in = *in;
+        size_t probe_left = *in_left;
+        char buf[4];
+        char *probe_out = buf;
+        size_t probe_out_left = sizeof(buf);
+        iconv(probe_, &probe_in, &probe_left, &probe_out, &probe_out_left);
+        if (probe_out_left != 0) {
+            errno = EILSEQ;
+            return false;
+        }
+        if (*out_left < substitute_.size()) {
+            errno = E2BIG;
+            return false;
+        }
+        std::memcpy(*out, substitute_.data(), substitute_.size());
+        *out += substitute_.size();
+        *out_left -= substitute_.size();
+        *in_left -= probe_in - *in;
+        *in = probe_in;
+        return true;
+    }
+
+    iconv_t cd_;
+    iconv_t probe_ = (iconv_t)-1;
+    std::string substitute_;
+};
+
+class iconv_backend_t : public conversion_backend_t
+{
+public:
+    const char *name() const override
+    {
+        return "iconv";
+    }
+    std::unique_ptr<conversion_t> open(const std::string &to_encoding, const std::string &from_encoding, native::unmappable_t unmappable) const override
+    {
+        iconv_t cd = iconv_open(to_encoding.c_str(), from_encoding.c_str());
+        if (cd == (iconv_t)-1) {
+            return nullptr;
+        }
+        return std::make_unique<iconv_conversion_t>(cd, to_encoding, from_encoding, unmappable);
+    }
+};
+
+#if WITH_ICU_BACKEND
+class icu_conversion_t : public conversion_t
+{
+public:
+    icu_conversion_t(UConverter *to, UConverter *from)
+        : to_(to)
+        , from_(from)
+    {
+        switch (ucnv_getType(from)) {
+        // resetting these to hand back a partial character would also forget the shift state
+        case UCNV_ISO_2022:
+        case UCNV_HZ:
+        case UCNV_UTF7:
+        case UCNV_IMAP_MAILBOX:
+        case UCNV_SCSU:
+        case UCNV_BOCU1:
+        case UCNV_EBCDIC_STATEFUL:
+            keeps_partial_ = true;
+            break;
+        // these forget the byte order of their signature, which is fed to them again
+        case UCNV_UTF16:
+            signature_size_ = 2;
+            break;
+        case UCNV_UTF32:
+            signature_size_ = 4;
+            break;
+        default:
+            break;
+        }
+    }
+    ~icu_conversion_t() override
+    {
+        ucnv_close(to_);
+        ucnv_close(from_);
+    }
+
+    size_t convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) override
+    {
+        // only the end of the input flushes, so that chunks do not each end in a return to the initial state
+        if (inbuf == nullptr || *inbuf == nullptr) {
+            // the next input starts over, with a signature of its own
+            head_.clear();
+            if (outbuf == nullptr || *outbuf == nullptr) {
+                ucnv_reset(to_);
+                ucnv_reset(from_);
+                pivot_source_ = pivot_target_ = pivot_;
+                return 0;
+            }
+            const char *source = "";
+            char *target = *outbuf;
+            UErrorCode err = U_ZERO_ERROR;
+            ucnv_convertEx(to_, from_, &target, target + *outbytesleft, &source, source,
+                           pivot_, &pivot_source_, &pivot_target_, pivot_ + pivot_size, false, true, &err);
+            *outbytesleft -= target - *outbuf;
+            *outbuf = target;
+            return result(err);
+        }
+
+        const char *source = *inbuf;
+        char *target = *outbuf;
+        UErrorCode err = U_ZERO_ERROR;
+        ucnv_convertEx(to_, from_, &target, target + *outbytesleft, &source, source + *inbytesleft,
+                       pivot_, &pivot_source_, &pivot_target_, pivot_ + pivot_size, false, false, &err);
+        // the converter takes in a signature however it is split, and nothing is pending until it is complete
+        if (head_.size() < signature_size_) {
+            head_.append(*inbuf, std::min<size_t>(source - *inbuf, signature_size_ - head_.size()));
+        }
+        if (U_SUCCESS(err) && !keeps_partial_) {
+            // a trailing partial character is handed back like iconv does
+            UErrorCode pending_err = U_ZERO_ERROR;
+            const int32_t pending = ucnv_toUCountPending(from_, &pending_err);
+            if (U_SUCCESS(pending_err) && pending > 0) {
+                source -= pending;
+                ucnv_resetToUnicode(from_);
+                if (head_.size() == signature_size_ && is_signature(head_)) {
+                    UChar none[1];
+                    UChar *none_target = none;
+                    const char *signature = head_.data();
+                    UErrorCode signature_err = U_ZERO_ERROR;
+                    ucnv_toUnicode(from_, &none_target, none + 1, &signature, signature + head_.size(), nullptr, false, &signature_err);
+                }
+                err = U_TRUNCATED_CHAR_FOUND;
+            }
+        }
+        *inbytesleft -= source - *inbuf;
+        *inbuf = const_cast<char *>(source);
+        *outbytesleft -= target - *outbuf;
+        *outbuf = target;
+        return result(err);
+    }
+
+private:
+    static constexpr size_t pivot_size = 1024;
+
+    static bool is_signature(std::string_view bytes)
+    {
+        using namespace std::string_view_literals;
+        return bytes == "\xFF\xFE"sv || bytes == "\xFE\xFF"sv || bytes == "\xFF\xFE\0\0"sv || bytes == "\0\0\xFE\xFF"sv;
+    }
+
+    static size_t result(UErrorCode err)
+    {
+        if (U_SUCCESS(err)) {
+            return 0;
+        }
+        errno = err == U_BUFFER_OVERFLOW_ERROR ? E2BIG : err == U_TRUNCATED_CHAR_FOUND ? EINVAL : EILSEQ;
+        return static_cast<size_t>(-1);
+    }
+
+    UConverter *to_;
+    UConverter *from_;
+    UChar pivot_[pivot_size];
+    UChar *pivot_source_ = pivot_;
+    UChar *pivot_target_ = pivot_;
+    bool keeps_partial_ = false; // a partial character at the end stays in `from_` until the next call or the flush
+    size_t signature_size_ = 0; // of the byte order mark of UTF-16 and UTF-32, 0 for other inputs
+    std::string head_; // the first signature_size_ bytes of the input
+};
+
+class icu_backend_t : public conversion_backend_t
+{
+public:
+    const char *name() const override
+    {
+        return "icu";
+    }
+    std::unique_ptr<conversion_t> open(const std::string &to_encoding, const std::string &from_encoding, native::unmappable_t unmappable) const override
+    {
+        UErrorCode err = U_ZERO_ERROR;
+        UConverter *from = ucnv_open(from_encoding.c_str(), &err);
+        if (U_FAILURE(err)) {
+            return nullptr;
+        }
+        UConverter *to = ucnv_open(to_encoding.c_str(), &err);
+        if (U_FAILURE(err)) {
+            ucnv_close(from);
+            return nullptr;
+        }
+        // ICU substitutes by default, iconv stops: invalid input always fails, unmappable output as configured
+        ucnv_setToUCallBack(from, UCNV_TO_U_CALLBACK_STOP, nullptr, nullptr, nullptr, &err);
+        switch (unmappable) {
+        case native::unmappable_t::fail:
+            ucnv_setFromUCallBack(to, UCNV_FROM_U_CALLBACK_STOP, nullptr, nullptr, nullptr, &err);
+            break;
+        case native::unmappable_t::skip:
+            ucnv_setFromUCallBack(to, UCNV_FROM_U_CALLBACK_SKIP, nullptr, nullptr, nullptr, &err);
+            break;
+        case native::unmappable_t::substitute:
+            ucnv_setFromUCallBack(to, UCNV_FROM_U_CALLBACK_SUBSTITUTE, nullptr, nullptr, nullptr, &err);
+            ucnv_setSubstString(to, u"?", 1, &err);
+            break;
+        }
+        if (U_FAILURE(err)) {
+            ucnv_close(from);
+            ucnv_close(to);
+            return nullptr;
+        }
+        return std::make_unique<icu_conversion_t>(to, from);
+    }
+};
+#endif
+
+// Convert the whole sample with a fresh conversion, true if it succeeded (a truncated last character is fine)
+bool run_sample(conversion_t &conversion, const std::vector<char> &sample, std::vector<char> &output)
+{
+    char *in = const_cast<char *>(sample.data());
+    size_t in_left = sample.size();
+    char *out = output.data();
+    size_t out_left = output.size();
+    const size_t result = conversion.convert(&in, &in_left, &out, &out_left);
+    return result != (size_t)-1 || errno == EINVAL;
+}
+}
+
+const std::vector<const conversion_backend_t *> &available_backends()
+{
+    static const native_backend_t native_backend;
+    static const iconv_backend_t iconv_backend;
+#if WITH_ICU_BACKEND
+    static const icu_backend_t icu_backend;
+    static const std::vector<const conversion_backend_t *> backends{&native_backend, &iconv_backend, &icu_backend};
+#else
+    static const std::vector<const conversion_backend_t *> backends{&native_backend, &iconv_backend};
+#endif
+    return backends;
+}
+
+const conversion_backend_t *find_backend(const std::string &name)
+{
+    for (const auto *backend : available_backends()) {
+        if (name == backend->name()) {
+            return backend;
+        }
+    }
+    return nullptr;
+}
+
+backend_selector_t::backend_selector_t(const std::string &mode, bool verbose)
+    : verbose_(verbose)
+{
+    if (mode == "auto") {
+        return;
+    }
+    fixed_ = find_backend(mode);
+    if (fixed_ == nullptr) {
+        throw std::invalid_argument("unknown or unavailable backend: " + mode);
+    }
+}
+
+std::unique_ptr<conversion_t> backend_selector_t::open(const std::string &to_encoding,
+                                                       const std::string &from_encoding,
+                                                       native::unmappable_t unmappable,
+                                                       const std::vector<char> &sample)
+{
+    const conversion_backend_t *backend = fixed_;
+    if (backend == nullptr) {
+        const auto key = std::make_pair(to_encoding, from_encoding);
+        bool calibrating = false;
+        {
+            std::lock_guard lck(mtx_);
+            if (const auto it = chosen_.find(key); it != chosen_.end()) {
+                backend = it->second;
+            } else if (sample.size() >= min_calibration_sample) {
+                // claim the pair, other threads keep to the order of preference until the choice is published
+                chosen_.emplace(key, nullptr);
+                calibrating = true;
+            }
+        }
+        if (calibrating) {
+            try {
+                backend = calibrate(to_encoding, from_encoding, unmappable, sample);
+            } catch (...) {
+                std::lock_guard lck(mtx_);
+                chosen_.erase(key);
+                throw;
+            }
+            std::lock_guard lck(mtx_);
+            chosen_[key] = backend;
+        }
+    }
+    if (backend == nullptr) {
+        for (const auto *preferred : available_backends()) {
+            if (auto conversion = preferred->open(to_encoding, from_encoding, unmappable)) {
+                return conversion;
+            }
+        }
+        return nullptr;
+    }
+    if (auto conversion = backend->open(to_encoding, from_encoding, unmappable)) {
+        return conversion;
+    }
+    // iconv is the reference implementation and handles whatever the others cannot
+    return find_backend("iconv")->open(to_encoding, from_encoding, unmappable);
+}
+
+const conversion_backend_t *backend_selector_t::calibrate(const std::string &to_encoding,
+                                                          const std::string &from_encoding,
+                                                          native::unmappable_t unmappable,
+                                                          const std::vector<char> &sample) const
+{
+    // a few hundred KiB is enough to rank the backends without noticeably delaying the first file
+    constexpr size_t max_sample = 256 * 1024;
+    const std::vector<char> input(sample.begin(), sample.begin() + std::min(sample.size(), max_sample));
+    std::vector<char> output(input.size() * 4 + 16);
+
+    const conversion_backend_t *best = find_backend("iconv");
+    double best_time = -1;
+    std::osyncstream sout(std::cout);
+    for (const auto *backend : available_backends()) {
+        double elapsed = -1;
+        // best of three runs, each with a fresh conversion as in real use
+        for (int i = 0; i < 3; ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            auto conversion = backend->open(to_encoding, from_encoding, unmappable);
+            if (!conversion || !run_sample(*conversion, input, output)) {
+                elapsed = -1;
+                break;
+            }
+            const double t = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            elapsed = elapsed < 0 ? t : std::min(elapsed, t);
+        }
+        if (verbose_) {
+            sout << "calibrate " << from_encoding << " -> " << to_encoding << ": " << backend->name() << ' ';
+            if (elapsed < 0) {
+                sout << "unavailable\n";
+            } else {
+                sout << elapsed << "us\n";
+            }
+        }
+        if (elapsed >= 0 && (best_time < 0 || elapsed < best_time)) {
+            best = backend;
+            best_time = elapsed;
+        }
+    }
+    if (verbose_) {
+        sout << "backend for " << from_encoding << " -> " << to_encoding << ": " << best->name() << '\n';
+    }
+    return best;
+}
@@ -0,0 +1,66 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "native_codec.h"
+
+// One open conversion for an encoding pair, with the calling convention of iconv(3):
+// returns (size_t)-1 and sets errno to E2BIG, EILSEQ or EINVAL on failure. A null inbuf or *inbuf ends the input:
+// a stateful output encoding is returned to its initial state, and without outbuf the state is only reset.
+class conversion_t
+{
+public:
+    virtual ~conversion_t() = default;
+    virtual size_t convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft) = 0;
+};
+
+// A conversion library. Backends are stateless and shared between threads.
+class conversion_backend_t
+{
+public:
+    virtual ~conversion_backend_t() = default;
+    virtual const char *name() const = 0;
+    // nullptr if this backend cannot convert the pair
+    virtual std::unique_ptr<conversion_t> open(const std::string &to_encoding, const std::string &from_encoding, native::unmappable_t unmappable) const = 0;
+};
+
+// Backends compiled into this build, in order of preference; iconv is always present
+const std::vector<const conversion_backend_t *> &available_backends();
+const conversion_backend_t *find_backend(const std::string &name);
+
+// Picks the backend for each encoding pair: a fixed one (falling back to iconv if it cannot handle the pair),
+// or with "auto" the fastest one on the first input of at least min_calibration_sample bytes seen for the pair,
+// remembered for the rest of the run. Until then, and while another thread calibrates, the order of preference holds.
+class backend_selector_t
+{
+public:
+    // throws std::invalid_argument for an unknown or unavailable backend name
+    explicit backend_selector_t(const std::string &mode = "native", bool verbose = false);
+
+    // smaller samples say too little about the speed of a backend
+    static constexpr size_t min_calibration_sample = 64 * 1024;
+
+    // `sample` is only used for calibration in auto mode; nullptr if no backend can convert the pair
+    std::unique_ptr<conversion_t> open(const std::string &to_encoding,
+                                       const std::string &from_encoding,
+                                       native::unmappable_t unmappable,
+                                       const std::vector<char> &sample);
+
+private:
+    const conversion_backend_t *calibrate(const std::string &to_encoding,
+                                          const std::string &from_encoding,
+                                          native::unmappable_t unmappable,
+                                          const std::vector<char> &sample) const;
+
+    const conversion_backend_t *fixed_ = nullptr; // nullptr in auto mode
+    bool verbose_;
+    std::mutex mtx_; // guards only the lookup, calibration runs outside of it
+    std::map<std::pair<std::string, std::string>, const conversion_backend_t *> chosen_; // nullptr while calibrating
+};
+
+#endif // BACKEND_H
@@ -0,0 +1,384 @@
+#include "detect.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <iconv.h>
+#include <unistd.h>
+
+#include "native_codec.h"
+#include "simd.h"
+
+namespace detect
+{
+namespace
+{
+// Bytes below 0x40 are never the trail byte of a multibyte character in the supported encodings,
+// so a window may start or end next to one without cutting a character in half.
+bool is_boundary(char c)
+{
+    return static_cast<unsigned char>(c) < 0x40;
+}
+
+size_t window_begin(const char *data, size_t pos, size_t floor, size_t context)
+{
+    size_t lower = pos - floor > context ? pos - context : floor;
+    for (size_t i = pos; i > lower; --i) {
+        if (data[i - 1] == '\n') {
+            return i;
+        }
+    }
+    while (lower > floor && lower < pos && !is_boundary(data[lower])) {
+        ++lower;
+    }
+    return lower;
+}
+
+size_t window_end(const char *data, size_t size, size_t pos, size_t context)
+{
+    size_t upper = size - pos > context ? pos + context : size;
+    if (const void *nl = std::memchr(data + pos, '\n', upper - pos)) {
+        return static_cast<const char *>(nl) - data + 1;
+    }
+    while (upper < size && !is_boundary(data[upper])) {
+        ++upper;
+    }
+    return upper;
+}
+
+// Position just past the line break ending at `nl`, including the NUL bytes that follow it in UTF-16LE and UTF-32LE
+size_t after_line_break(const char *data, size_t size, size_t nl)
+{
+    size_t pos = nl + 1;
+    for (size_t n = 0; n < 3 && pos < size && data[pos] == '\0'; ++n) {
+        ++pos;
+    }
+    return pos;
+}
+
+struct code_unit_t
+{
+    size_t size = 1;
+    bool big_endian = false;
+};
+
+// Code units of UTF-16 and UTF-32 text, told by its byte order mark or its NUL bytes; single bytes for anything else
+code_unit_t code_unit(const char *data, size_t size)
+{
+    const std::string_view head(data, std::min<size_t>(size, 4));
+    if (head == std::string_view("\xFF\xFE\0\0", 4) || head == std::string_view("\0\0\xFE\xFF", 4)) {
+        return {4, head[0] == '\0'};
+    }
+    if (head.starts_with("\xFF\xFE") || head.starts_with("\xFE\xFF")) {
+        return {2, head[0] == '\xFE'};
+    }
+    if (const char *wide = wide_unicode(data, size)) {
+        const std::string_view name = wide;
+        return {name.starts_with("UTF-32") ? size_t(4) : size_t(2), name.ends_with("BE")};
+    }
+    return {};
+}
+
+// Position just past the first line feed of `data`, or the last one if `last`, that is a whole code unit; npos if none.
+// `data` starts at a code unit boundary.
+size_t wide_line_break(const char *data, size_t size, code_unit_t unit, bool last)
+{
+    const size_t units = size / unit.size;
+    for (size_t k = 0; k < units; ++k) {
+        const char *const p = data + (last ? units - 1 - k : k) * unit.size;
+        const char *const low = unit.big_endian ? p + unit.size - 1 : p;
+        if (*low == '\n' && std::count(p, p + unit.size, '\0') == static_cast<std::ptrdiff_t>(unit.size - 1)) {
+            return p + unit.size - data;
+        }
+    }
+    return std::string_view::npos;
+}
+
+// Text may contain tab, line feed, vertical tab, form feed, carriage return and escape among the C0 controls
+bool is_text_char(char32_t c)
+{
+    return c >= 0x20 || (c >= 0x09 && c <= 0x0D) || c == 0x1B;
+}
+
+bool valid_utf16(const std::uint8_t *data, size_t size, bool big_endian)
+{
+    bool high_pending = false;
+    for (size_t i = 0; i + 2 <= size; i += 2) {
+        const char32_t c = big_endian ? (data[i] << 8 | data[i + 1]) : (data[i + 1] << 8 | data[i]);
+        const bool high = c >= 0xD800 && c < 0xDC00;
+        const bool low = c >= 0xDC00 && c < 0xE000;
+        if (high_pending != low || !is_text_char(c)) {
+            return false;
+        }
+        high_pending = high;
+    }
+    return true;
+}
+
+bool valid_utf32(const std::uint8_t *data, size_t size, bool big_endian)
+{
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        const char32_t c = big_endian ? (char32_t(data[i]) << 24 | data[i + 1] << 16 | data[i + 2] << 8 | data[i + 3])
+                                      : (char32_t(data[i + 3]) << 24 | data[i + 2] << 16 | data[i + 1] << 8 | data[i]);
+        if (c > 0x10FFFF || (c >= 0xD800 && c < 0xE000) || !is_text_char(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::optional<declaration_t> make_declaration(const char *data, const std::cmatch &match)
+{
+    const size_t begin = match[1].first - data;
+    return declaration_t{begin, begin + match.length(1), normalize_charset(match.str(1))};
+}
+
+struct fd_guard_t
+{
+    ~fd_guard_t()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    int fd;
+};
+
+void read_at(int fd, char *data, size_t size, off_t offset, const std::filesystem::path &path)
+{
+    while (size > 0) {
+        const ssize_t n = ::pread(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to read: " + path.string());
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+}
+
+std::vector<window_t> non_ascii_windows(const char *data, size_t size, size_t context)
+{
+    constexpr size_t ascii_sample = 4096;
+    std::vector<window_t> windows;
+    if (std::memchr(data, '\x1B', size) != nullptr || std::memchr(data, '\0', size) != nullptr) {
+        return windows;
+    }
+
+    size_t covered = 0;
+    size_t pos = 0;
+    while (true) {
+        pos += native::ascii_prefix(data + pos, size - pos);
+        if (pos == size) {
+            break;
+        }
+        const size_t floor = windows.empty() ? 0 : windows.back().end;
+        const size_t begin = window_begin(data, pos, floor, context);
+        // the window keeps growing line by line while the next non-ASCII byte is within reach of its end
+        size_t end = window_end(data, size, pos, context);
+        while (end < size) {
+            const size_t next = end + native::ascii_prefix(data + end, std::min(context, size - end));
+            if (next == size || next - end == context) {
+                break;
+            }
+            end = window_end(data, size, next, context);
+        }
+        covered += end - begin;
+        if (covered * 2 > size) {
+            windows.clear();
+            return windows;
+        }
+        windows.push_back({begin, end});
+        pos = end;
+    }
+
+    if (windows.empty()) {
+        windows.push_back({0, std::min(size, ascii_sample)});
+    }
+    return windows;
+}
+
+const char *wide_unicode(const char *data, size_t size)
+{
+    const auto *p = reinterpret_cast<const std::uint8_t *>(data);
+    size &= ~size_t(3);
+    if (size < 4 || (p[0] == 0xFF && p[1] == 0xFE) || (p[0] == 0xFE && p[1] == 0xFF)) {
+        return nullptr;
+    }
+    size_t nuls[4] = {0, 0, 0, 0};
+    simd::count_nuls(p, size, nuls);
+    if (nuls[0] + nuls[1] + nuls[2] + nuls[3] == 0) {
+        return nullptr;
+    }
+
+    // the top byte of a UTF-32 code unit is always NUL and the next one is for everything in the BMP
+    const size_t units32 = size / 4;
+    if (nuls[3] == units32 && nuls[2] * 10 >= units32 * 9) {
+        return valid_utf32(p, size, false) ? "UTF-32LE" : nullptr;
+    }
+    if (nuls[0] == units32 && nuls[1] * 10 >= units32 * 9) {
+        return valid_utf32(p, size, true) ? "UTF-32BE" : nullptr;
+    }
+    // in UTF-16 the high byte is NUL for ASCII and Latin-1, the low byte only for the odd U+xx00 character
+    const size_t units16 = size / 2;
+    const size_t even = nuls[0] + nuls[2];
+    const size_t odd = nuls[1] + nuls[3];
+    if (odd * 4 >= units16 && even * 8 <= odd) {
+        return valid_utf16(p, size, false) ? "UTF-16LE" : nullptr;
+    }
+    if (even * 4 >= units16 && odd * 8 <= even) {
+        return valid_utf16(p, size, true) ? "UTF-16BE" : nullptr;
+    }
+    return nullptr;
+}
+
+std::string declared_name(const declaration_t &declaration, const char *data, const std::string &encoding)
+{
+    std::string name = encoding;
+    if (std::none_of(data + declaration.begin, data + declaration.end, [](unsigned char c) { return std::isupper(c); })) {
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+    }
+    return name;
+}
+
+std::string normalize_charset(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+        return c == '_' ? '-' : static_cast<char>(std::toupper(c));
+    });
+    if (name.starts_with("X-")) {
+        name.erase(0, 2);
+    }
+    if (name == "UTF8") {
+        return "UTF-8";
+    }
+    if (name.starts_with("LATIN-")) {
+        name.erase(5, 1);
+    }
+    if (name == "SHIFT-JIS") {
+        return "SHIFT_JIS";
+    }
+    return name;
+}
+
+std::optional<declaration_t> find_declaration(const char *data, size_t size)
+{
+    // the same limits as the HTML prescan and Vim's default 'modelines'
+    constexpr size_t head_bytes = 1024;
+    constexpr size_t head_lines = 5;
+    constexpr size_t cookie_lines = 2;
+    static const auto flags = std::regex::ECMAScript | std::regex::icase | std::regex::optimize;
+    static const std::regex xml(R"(^<\?xml[^>]*?\sencoding\s*=\s*["']([-\w.:]+)["'])", flags);
+    // "coding" must start a word, so that "decoding: ..." in an ordinary comment is not taken for a cookie
+    static const std::regex coding(R"(^[ \t\f]*(?:#|//|/\*|--|;|<!--)(?:.*?[^-\w])?coding[:=][ \t]*([-\w.]+))", flags);
+    static const std::regex vim(R"((?:^|\s)(?:vi|vim|ex):.*?\b(?:fileencoding|fenc)=([-\w.]+))", flags);
+    static const std::regex meta(R"(<meta\s[^>]*?charset\s*=\s*["']?([-\w.:]+))", flags);
+
+    const char *const end = data + std::min(size, head_bytes);
+    std::cmatch match;
+    if (std::regex_search(data, end, match, xml)) {
+        return make_declaration(data, match);
+    }
+    const char *line = data;
+    for (size_t i = 0; i < head_lines && line < end; ++i) {
+        const char *line_end = static_cast<const char *>(std::memchr(line, '\n', end - line));
+        line_end = line_end == nullptr ? end : line_end;
+        if ((i < cookie_lines && std::regex_search(line, line_end, match, coding)) || std::regex_search(line, line_end, match, vim)) {
+            return make_declaration(data, match);
+        }
+        line = line_end + 1;
+    }
+    if (std::regex_search(data, end, match, meta)) {
+        return make_declaration(data, match);
+    }
+    return std::nullopt;
+}
+
+std::optional<declaration_t> find_declaration(const char *data, size_t size, const std::string &encoding)
+{
+    auto declaration = find_declaration(data, size);
+    if (!declaration || declaration->charset != normalize_charset(encoding)) {
+        return std::nullopt;
+    }
+    const iconv_t cd = iconv_open("UTF-8", declaration->charset.c_str());
+    if (cd == (iconv_t)-1) {
+        return std::nullopt;
+    }
+    iconv_close(cd);
+    return declaration;
+}
+
+std::vector<char> sample_file(const std::filesystem::path &path, size_t file_size, size_t windows, size_t window_size)
+{
+    std::vector<char> sample;
+    if (file_size <= windows * window_size) {
+        windows = 1;
+        window_size = file_size;
+    }
+    fd_guard_t file{::open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (file.fd < 0) {
+        throw std::runtime_error("cannot open file: " + path.string());
+    }
+
+    sample.resize(windows * window_size);
+    size_t used = 0;
+    code_unit_t unit;
+    for (size_t i = 0; i < windows; ++i) {
+        // windows of UTF-16 and UTF-32 text start at a code unit, like the head the unit is told from
+        const size_t offset = windows == 1 ? 0 : (file_size - window_size) * i / (windows - 1) / unit.size * unit.size;
+        char *window = sample.data() + used;
+        read_at(file.fd, window, window_size, offset, path);
+        if (i == 0) {
+            unit = code_unit(window, window_size);
+        }
+
+        size_t begin = 0;
+        size_t end = window_size;
+        if (unit.size > 1) {
+            // a '\n' byte alone may be half of a code unit such as U+0A0D
+            if (offset > 0) {
+                if (const size_t pos = wide_line_break(window, window_size, unit, false); pos != std::string_view::npos) {
+                    begin = pos;
+                }
+            }
+            if (offset + window_size < file_size) {
+                if (const size_t pos = wide_line_break(window, window_size, unit, true); pos != std::string_view::npos) {
+                    end = pos;
+                }
+            }
+        } else if (offset > 0) {
+            if (const void *nl = std::memchr(window, '\n', window_size)) {
+                begin = after_line_break(window, window_size, static_cast<const char *>(nl) - window);
+            }
+        }
+        if (unit.size == 1 && offset + window_size < file_size) {
+            for (size_t j = window_size; j > begin; --j) {
+                if (window[j - 1] == '\n') {
+                    end = after_line_break(window, window_size, j - 1);
+                    break;
+                }
+            }
+        }
+        if (begin >= end) {
+            begin = 0;
+            end = window_size;
+        }
+        std::memmove(window, window + begin, end - begin);
+        used += end - begin;
+    }
+    sample.resize(used);
+    return sample;
+}
+}
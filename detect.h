@@ -0,0 +1,54 @@
+#ifndef DETECT_H
+#define DETECT_H
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace detect
+{
+struct window_t
+{
+    size_t begin;
+    size_t end;
+};
+
+// Byte ranges worth handing to a statistical detector: the lines around non-ASCII bytes, each clipped to `context`
+// bytes on either side of them, or a short prefix of a pure ASCII buffer. Empty if the whole buffer should be used
+// instead, i.e. for escape-based 7-bit encodings, NULs of UTF-16/32, or when the windows would cover most of it.
+std::vector<window_t> non_ascii_windows(const char *data, size_t size, size_t context = 256);
+
+// UTF-16LE/BE or UTF-32LE/BE recognised from the positions of NUL bytes and the validity of the code units, for
+// files without a BOM (those are left to uchardet); nullptr if `data` is not one of them. A partial last unit is ignored.
+const char *wide_unicode(const char *data, size_t size);
+
+// Charset declared by the file itself: an XML prolog, an HTML <meta> charset, a Python/Emacs coding cookie in the
+// first two lines (as PEP 263) or a Vim fileencoding modeline in the first five. `begin`/`end` delimit the charset
+// name as written in the data.
+struct declaration_t
+{
+    size_t begin;
+    size_t end;
+    std::string charset; // normalised to a name iconv understands
+};
+std::optional<declaration_t> find_declaration(const char *data, size_t size);
+// The declaration of `data` only if it names `encoding`, the encoding the data is actually in, and iconv knows the
+// name; anything else may be a comment that merely looks like a declaration and must not be rewritten
+std::optional<declaration_t> find_declaration(const char *data, size_t size, const std::string &encoding);
+// `encoding` as it should replace the declared name in `data`, i.e. in lower case if the declaration was
+std::string declared_name(const declaration_t &declaration, const char *data, const std::string &encoding);
+
+// Charset names are declared in the style of each language or tool (utf8, latin-1, euc_jp, x-sjis), iconv wants its own
+std::string normalize_charset(std::string name);
+
+// Files above this size are detected from a sample rather than read whole
+inline constexpr size_t sample_threshold = 4 * 1024 * 1024;
+
+// Read the head, evenly spaced middle windows and the tail of a file with pread(2), concatenated and cut at line
+// breaks so that no character is split, except at a window without any line break. throws std::runtime_error
+std::vector<char> sample_file(const std::filesystem::path &path, size_t file_size, size_t windows = 8, size_t window_size = 256 * 1024);
+}
+
+#endif // DETECT_H
@@ -0,0 +1,403 @@
+#include "direct_io.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "detect.h"
+#include "output_check.h"
+#include "output_file.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+// O_DIRECT wants buffers, offsets and sizes aligned to the logical block size, a page covers every device
+constexpr size_t alignment = 4096;
+constexpr size_t chunk_size = 8 * 1024 * 1024;
+// room in front of an input chunk for the partial character left over from the previous one,
+// or for a rewritten charset declaration that is longer than the original
+constexpr size_t input_slack = alignment;
+constexpr size_t output_size = 2 * chunk_size;
+// transfers running at once, each holding about 48 MiB of buffers; further ones wait for a free context
+constexpr size_t max_contexts = 4;
+
+struct aligned_deleter_t
+{
+    void operator()(char *p) const
+    {
+        std::free(p);
+    }
+};
+using aligned_buffer_t = std::unique_ptr<char, aligned_deleter_t>;
+
+aligned_buffer_t make_aligned(size_t size)
+{
+    void *p = nullptr;
+    if (::posix_memalign(&p, alignment, size) != 0) {
+        throw std::bad_alloc();
+    }
+    return aligned_buffer_t(static_cast<char *>(p));
+}
+
+// Runs the reads and writes of a transfer one after another, next to the conversion on the calling thread
+class io_thread_t
+{
+public:
+    io_thread_t()
+        : thread_([this] { run(); })
+    {
+    }
+
+    ~io_thread_t()
+    {
+        {
+            std::lock_guard lck(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    template<typename F>
+    auto submit(F f) -> std::future<decltype(f())>
+    {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        auto future = task->get_future();
+        {
+            std::lock_guard lck(mtx_);
+            tasks_.push_back([task] { (*task)(); });
+        }
+        cv_.notify_all();
+        return future;
+    }
+
+    // wait until everything submitted has run, as the tasks refer to the state of the transfer
+    void drain()
+    {
+        std::unique_lock lck(mtx_);
+        cv_.wait(lck, [this] { return tasks_.empty() && !running_; });
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock lck(mtx_);
+        while (true) {
+            cv_.wait(lck, [this] { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            auto task = std::move(tasks_.front());
+            tasks_.pop_front();
+            running_ = true;
+            lck.unlock();
+            task();
+            lck.lock();
+            running_ = false;
+            cv_.notify_all();
+        }
+    }
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool running_ = false;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Double buffers and the I/O thread of a transfer, kept for the next one
+struct context_t
+{
+    aligned_buffer_t input[2] = {make_aligned(input_slack + chunk_size), make_aligned(input_slack + chunk_size)};
+    aligned_buffer_t output[2] = {make_aligned(output_size), make_aligned(output_size)};
+    io_thread_t io;
+};
+
+class context_pool_t
+{
+public:
+    // waits while max_contexts transfers are running
+    std::unique_ptr<context_t> acquire()
+    {
+        std::unique_lock lck(mtx_);
+        cv_.wait(lck, [this] { return in_use_ < max_contexts; });
+        ++in_use_;
+        if (!idle_.empty()) {
+            auto context = std::move(idle_.back());
+            idle_.pop_back();
+            return context;
+        }
+        lck.unlock();
+        try {
+            return std::make_unique<context_t>();
+        } catch (...) {
+            release(nullptr);
+            throw;
+        }
+    }
+
+    void release(std::unique_ptr<context_t> context)
+    {
+        {
+            std::lock_guard lck(mtx_);
+            --in_use_;
+            if (context) {
+                idle_.push_back(std::move(context));
+            }
+        }
+        cv_.notify_one();
+    }
+
+    void clear()
+    {
+        std::vector<std::unique_ptr<context_t>> idle;
+        std::lock_guard lck(mtx_);
+        idle.swap(idle_);
+    }
+
+private:
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<context_t>> idle_;
+    size_t in_use_ = 0;
+};
+
+context_pool_t contexts;
+
+// Hands the context back once its I/O thread has finished with the transfer
+struct context_guard_t
+{
+    ~context_guard_t()
+    {
+        // errno still tells the caller about a conversion error
+        const int error = errno;
+        context->io.drain();
+        contexts.release(std::move(context));
+        errno = error;
+    }
+    std::unique_ptr<context_t> context;
+};
+
+struct fd_guard_t
+{
+    ~fd_guard_t()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    int fd;
+};
+
+size_t read_chunk(int fd, char *data, off_t offset, const fs::path &path)
+{
+    size_t done = 0;
+    while (done < chunk_size) {
+        const ssize_t n = ::pread(fd, data + done, chunk_size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error("failed to read: " + path.string() + ": " + std::strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+        // only the end of the file gives a short read, and then the offset is no longer aligned
+        if (done % alignment != 0) {
+            break;
+        }
+    }
+    return done;
+}
+
+void write_all(int fd, const char *data, size_t size, off_t offset, const fs::path &path)
+{
+    while (size > 0) {
+        const ssize_t n = ::pwrite(fd, data, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to write: " + path.string() + ": " + std::strerror(errno));
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+}
+
+std::optional<bool> direct_transcode(conversion_t &conversion, const fs::path &input_filename, const fs::path &output_filename, const std::string &from_encoding, const std::string &to_encoding, output_check_t *check)
+{
+    fd_guard_t in{::open(input_filename.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC)};
+    if (in.fd < 0) {
+        if (errno == EINVAL) {
+            return std::nullopt;
+        }
+        throw std::runtime_error("cannot open file: " + input_filename.string());
+    }
+    fd_guard_t out{create_output(output_filename, O_WRONLY | O_DIRECT)};
+    if (out.fd < 0) {
+        if (errno == EINVAL) {
+            return std::nullopt;
+        }
+        throw std::runtime_error("cannot open file: " + output_filename.string());
+    }
+
+    // declared after the descriptors, so that pending reads and writes finish before those are closed
+    const context_guard_t guard{contexts.acquire()};
+    context_t &pool = *guard.context;
+    off_t read_offset = 0;
+    off_t write_offset = 0;
+    int current = 0;
+    size_t carried = 0; // bytes of a partial character in front of the current chunk
+    size_t pending = 0; // unaligned output left at the start of the current output buffer
+    std::future<void> writing;
+
+    // hand the aligned part of the output to the writer and move the rest in front of the other output buffer
+    int out_index = 0;
+    const auto flush = [&](size_t produced, bool last) {
+        const size_t aligned = last ? produced : produced / alignment * alignment;
+        if (writing.valid()) {
+            writing.get();
+        }
+        char *const data = pool.output[out_index].get();
+        if (check != nullptr) {
+            check->output(data, aligned);
+        }
+        if (last) {
+            const size_t body = produced / alignment * alignment;
+            write_all(out.fd, data, body, write_offset, output_filename);
+            // the unaligned tail cannot be written with O_DIRECT
+            ::fcntl(out.fd, F_SETFL, ::fcntl(out.fd, F_GETFL) & ~O_DIRECT);
+            write_all(out.fd, data + body, produced - body, write_offset + body, output_filename);
+            return;
+        }
+        pending = produced - aligned;
+        std::memcpy(pool.output[out_index ^ 1].get(), data + aligned, pending);
+        writing = pool.io.submit([fd = out.fd, data, aligned, offset = write_offset, &output_filename] { write_all(fd, data, aligned, offset, output_filename); });
+        write_offset += aligned;
+        out_index ^= 1;
+    };
+
+    // the end of the input returns a stateful output encoding to its initial state and writes out the rest
+    const auto finish = [&]() {
+        while (true) {
+            char *out_ptr = pool.output[out_index].get() + pending;
+            size_t out_left = output_size - pending;
+            const size_t result = conversion.convert(nullptr, nullptr, &out_ptr, &out_left);
+            const size_t produced = output_size - out_left;
+            if (result != (size_t)-1) {
+                flush(produced, true);
+                return true;
+            }
+            if (errno != E2BIG) {
+                if (writing.valid()) {
+                    writing.wait();
+                }
+                return false;
+            }
+            flush(produced, false);
+        }
+    };
+
+    size_t size = read_chunk(in.fd, pool.input[current].get() + input_slack, read_offset, input_filename);
+    read_offset += size;
+    bool first = true;
+    while (true) {
+        const bool last = size < chunk_size;
+        std::future<size_t> reading;
+        if (!last) {
+            reading = pool.io.submit([fd = in.fd, data = pool.input[current ^ 1].get() + input_slack, offset = read_offset, &input_filename] {
+                return read_chunk(fd, data, offset, input_filename);
+            });
+        }
+
+        char *chunk = pool.input[current].get() + input_slack;
+        if (first) {
+            if (const auto declaration = detect::find_declaration(chunk, size, from_encoding)) {
+                // shift everything before the declared name so that the chunk keeps its end
+                const std::string name = detect::declared_name(*declaration, chunk, to_encoding);
+                const ptrdiff_t delta = static_cast<ptrdiff_t>(name.size()) - static_cast<ptrdiff_t>(declaration->end - declaration->begin);
+                std::memmove(chunk - delta, chunk, declaration->begin);
+                std::memcpy(chunk - delta + declaration->begin, name.data(), name.size());
+                chunk -= delta;
+                size += delta;
+            }
+            first = false;
+        }
+        char *const converted = chunk - carried;
+        char *in_ptr = converted;
+        size_t in_left = size + carried;
+        int error = 0;
+        while (in_left > 0) {
+            char *out_ptr = pool.output[out_index].get() + pending;
+            size_t out_left = output_size - pending;
+            const size_t result = conversion.convert(&in_ptr, &in_left, &out_ptr, &out_left);
+            const size_t produced = output_size - out_left;
+            if (result != (size_t)-1) {
+                pending = produced;
+                break;
+            }
+            if (errno == E2BIG) {
+                flush(produced, false);
+                continue;
+            }
+            error = errno;
+            pending = produced;
+            break;
+        }
+        if (check != nullptr) {
+            check->input(converted, in_ptr - converted);
+        }
+
+        if (error == EINVAL && !last && in_left <= input_slack) {
+            // a character split across chunks continues in front of the next one
+            std::memcpy(pool.input[current ^ 1].get() + input_slack - in_left, in_ptr, in_left);
+            carried = in_left;
+        } else if (error != 0) {
+            if (reading.valid()) {
+                reading.wait();
+            }
+            if (writing.valid()) {
+                writing.wait();
+            }
+            errno = error;
+            return false;
+        } else {
+            carried = 0;
+        }
+
+        if (last) {
+            return finish();
+        }
+        flush(pending, false);
+        size = reading.get();
+        read_offset += size;
+        current ^= 1;
+        if (size == 0 && carried == 0) {
+            return finish();
+        }
+    }
+}
+
+void direct_io_release()
+{
+    contexts.clear();
+}
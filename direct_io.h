@@ -0,0 +1,29 @@
+#ifndef DIRECT_IO_H
+#define DIRECT_IO_H
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include "backend.h"
+
+class output_check_t;
+
+// Convert a file in chunks with O_DIRECT reads and writes, so that multi-gigabyte files neither go through the
+// page cache nor get read whole into memory. The next chunk is read while the current one converts, and the
+// previous output is written meanwhile. A declaration of `from_encoding` in the head is rewritten to `to_encoding`.
+// Returns nullopt if the filesystem does not support O_DIRECT (nothing has been written then), false with errno
+// set by the conversion on a conversion error; throws std::runtime_error on I/O errors.
+// `check`, if given, is fed the converted input and the output as the chunks go by.
+std::optional<bool> direct_transcode(conversion_t &conversion,
+                                     const std::filesystem::path &input_filename,
+                                     const std::filesystem::path &output_filename,
+                                     const std::string &from_encoding,
+                                     const std::string &to_encoding,
+                                     output_check_t *check = nullptr);
+
+// Free the buffers and I/O threads kept for later transfers, once no more files are converted
+void direct_io_release();
+
+#endif // DIRECT_IO_H
@@ -0,0 +1,223 @@
+#include "editorconfig.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+#include "detect.h"
+
+namespace fs = std::filesystem;
+
+namespace
+{
+std::string trim(const std::string &str)
+{
+    const auto begin = str.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+}
+
+std::string to_lower(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return std::tolower(c); });
+    return str;
+}
+
+void append_literal(std::string &re, char c)
+{
+    if (std::strchr(R"(\^$.|?*+()[]{}/)", c) != nullptr) {
+        re += '\\';
+    }
+    re += c;
+}
+
+// {num1..num2} expands to the alternation of the numbers, as long as the range stays reasonably small
+bool append_range(std::string &re, const std::string &body)
+{
+    const auto dots = body.find("..");
+    if (dots == std::string::npos) {
+        return false;
+    }
+    char *end = nullptr;
+    const long first = std::strtol(body.c_str(), &end, 10);
+    if (end != body.c_str() + dots) {
+        return false;
+    }
+    const long last = std::strtol(body.c_str() + dots + 2, &end, 10);
+    if (*end != '\0' || end == body.c_str() + dots + 2) {
+        return false;
+    }
+    const long lo = std::min(first, last);
+    const long hi = std::max(first, last);
+    if (hi - lo > 4096) {
+        return false;
+    }
+    re += "(?:";
+    for (long n = lo; n <= hi; ++n) {
+        re += (n == lo ? "" : "|") + std::to_string(n);
+    }
+    re += ')';
+    return true;
+}
+
+// Translate an EditorConfig section glob into a regex over paths relative to the .editorconfig directory
+std::string glob_to_regex(std::string glob)
+{
+    std::string re;
+    if (glob.find('/') == std::string::npos) {
+        re = "(?:.*/)?"; // a glob without slashes matches the filename at any depth
+    } else if (glob.front() == '/') {
+        glob.erase(0, 1);
+    }
+
+    int braces = 0;
+    for (size_t i = 0; i < glob.size(); ++i) {
+        const char c = glob[i];
+        if (c == '\\' && i + 1 < glob.size()) {
+            append_literal(re, glob[++i]);
+        } else if (c == '*') {
+            if (i + 1 < glob.size() && glob[i + 1] == '*') {
+                re += ".*";
+                ++i;
+            } else {
+                re += "[^/]*";
+            }
+        } else if (c == '?') {
+            re += "[^/]";
+        } else if (c == '[') {
+            const auto close = glob.find(']', i + 1);
+            if (close == std::string::npos || glob.find('/', i + 1) < close) {
+                append_literal(re, c);
+                continue;
+            }
+            re += '[';
+            size_t j = i + 1;
+            if (glob[j] == '!' || glob[j] == '^') {
+                re += '^';
+                ++j;
+            }
+            for (; j < close; ++j) {
+                if (glob[j] == '\\' || glob[j] == '[') {
+                    re += '\\';
+                }
+                re += glob[j];
+            }
+            re += ']';
+            i = close;
+        } else if (c == '{') {
+            const auto close = glob.find('}', i + 1);
+            if (close == std::string::npos) {
+                append_literal(re, c);
+                continue;
+            }
+            const std::string body = glob.substr(i + 1, close - i - 1);
+            if (body.find_first_of(",{") == std::string::npos) {
+                if (!append_range(re, body)) {
+                    // a single word in braces is literal
+                    for (char b : "{" + body + "}") {
+                        append_literal(re, b);
+                    }
+                }
+                i = close;
+                continue;
+            }
+            re += "(?:";
+            ++braces;
+        } else if (c == ',' && braces > 0) {
+            re += '|';
+        } else if (c == '}' && braces > 0) {
+            re += ')';
+            --braces;
+        } else {
+            append_literal(re, c);
+        }
+    }
+    return re;
+}
+}
+
+std::shared_ptr<const editorconfig_t::config_t> editorconfig_t::load(const fs::path &dir)
+{
+    {
+        std::lock_guard lck(mtx_);
+        if (const auto it = configs_.find(dir); it != configs_.end()) {
+            return it->second;
+        }
+    }
+
+    std::shared_ptr<config_t> config;
+    if (std::ifstream file(dir / ".editorconfig"); file.is_open()) {
+        config = std::make_shared<config_t>();
+        std::string line;
+        while (std::getline(file, line)) {
+            line = trim(line);
+            if (line.empty() || line.front() == '#' || line.front() == ';') {
+                continue;
+            }
+            if (line.front() == '[' && line.back() == ']') {
+                try {
+                    config->sections.push_back({std::regex(glob_to_regex(line.substr(1, line.size() - 2))), std::nullopt});
+                } catch (const std::regex_error &) {
+                    // a section that cannot be matched is dropped along with its properties
+                    config->sections.push_back({std::regex("$^"), std::nullopt});
+                }
+                continue;
+            }
+            const auto eq = line.find('=');
+            if (eq == std::string::npos) {
+                continue;
+            }
+            const std::string key = to_lower(trim(line.substr(0, eq)));
+            const std::string value = to_lower(trim(line.substr(eq + 1)));
+            if (config->sections.empty()) {
+                if (key == "root") {
+                    config->root = value == "true";
+                }
+            } else if (key == "charset") {
+                config->sections.back().charset = value == "unset" ? "" : value;
+            }
+        }
+    }
+
+    std::lock_guard lck(mtx_);
+    return configs_.emplace(dir, std::move(config)).first->second;
+}
+
+std::optional<std::string> editorconfig_t::charset(const fs::path &file)
+{
+    // closest .editorconfig first, up to the one marked root
+    std::vector<std::pair<fs::path, std::shared_ptr<const config_t>>> chain;
+    for (fs::path dir = file.parent_path();; dir = dir.parent_path()) {
+        if (auto config = load(dir)) {
+            const bool root = config->root;
+            chain.emplace_back(dir, std::move(config));
+            if (root) {
+                break;
+            }
+        }
+        if (dir == dir.parent_path()) {
+            break;
+        }
+    }
+
+    std::optional<std::string> charset;
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        const std::string relative = file.lexically_relative(it->first).generic_string();
+        for (const auto &section : it->second->sections) {
+            if (section.charset && std::regex_match(relative, section.glob)) {
+                charset = *section.charset;
+            }
+        }
+    }
+    if (!charset || charset->empty()) {
+        return std::nullopt;
+    }
+    if (*charset == "utf-8-bom") {
+        return utf8_bom;
+    }
+    return detect::normalize_charset(*charset);
+}
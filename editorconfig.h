@@ -0,0 +1,43 @@
+#ifndef EDITORCONFIG_H
+#define EDITORCONFIG_H
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <regex>
+#include <string>
+#include <vector>
+
+// `charset` of the .editorconfig files above a path (https://editorconfig.org), the closest file and the last
+// matching section winning. Each directory's .editorconfig is read and its globs compiled once, shared by all threads.
+class editorconfig_t
+{
+public:
+    // utf-8-bom, which iconv does not know: UTF-8 for detection, but the conversions cannot write the BOM
+    static constexpr const char *utf8_bom = "UTF-8-BOM";
+
+    // nullopt if no .editorconfig declares a charset for the file; the name is normalised for iconv except utf8_bom
+    std::optional<std::string> charset(const std::filesystem::path &file);
+
+private:
+    struct section_t
+    {
+        std::regex glob;
+        std::optional<std::string> charset; // "unset" is kept as an empty string
+    };
+    struct config_t
+    {
+        bool root = false;
+        std::vector<section_t> sections;
+    };
+
+    // nullptr if the directory has no .editorconfig
+    std::shared_ptr<const config_t> load(const std::filesystem::path &dir);
+
+    std::mutex mtx_;
+    std::map<std::filesystem::path, std::shared_ptr<const config_t>> configs_;
+};
+
+#endif // EDITORCONFIG_H
@@ -0,0 +1,148 @@
+#include "follow.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "native_codec.h"
+#include "output_file.h"
+
+follower_t::follower_t(backend_selector_t &backends,
+                       const std::filesystem::path &input,
+                       const std::filesystem::path &output,
+                       const std::string &from_encoding,
+                       const std::string &to_encoding,
+                       native::unmappable_t unmappable,
+                       detect_t detect,
+                       rewrite_t rewrite)
+    : backends_(backends)
+    , input_path_(input)
+    , output_path_(output)
+    , from_encoding_(from_encoding)
+    , to_encoding_(to_encoding)
+    , unmappable_(unmappable)
+    , detect_(std::move(detect))
+    , rewrite_(std::move(rewrite))
+{
+    input_ = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+    if (input_ < 0) {
+        throw std::runtime_error("cannot open file: " + input.string() + ": " + std::strerror(errno));
+    }
+    output_ = create_output(output, O_WRONLY);
+    if (output_ < 0) {
+        ::close(input_);
+        throw std::runtime_error("cannot open file: " + output.string() + ": " + std::strerror(errno));
+    }
+}
+
+follower_t::~follower_t()
+{
+    ::close(input_);
+    ::close(output_);
+}
+
+void follower_t::restart()
+{
+    if (::ftruncate(output_, 0) != 0 || ::lseek(output_, 0, SEEK_SET) != 0) {
+        throw std::runtime_error("cannot truncate output file: " + output_path_.string() + ": " + std::strerror(errno));
+    }
+    offset_ = 0;
+    carry_.clear();
+    conversion_.reset();
+}
+
+std::uint64_t follower_t::update()
+{
+    struct stat st;
+    if (::fstat(input_, &st) != 0) {
+        throw std::runtime_error("cannot stat file: " + input_path_.string() + ": " + std::strerror(errno));
+    }
+    if (static_cast<std::uint64_t>(st.st_size) < offset_) {
+        restart();
+    }
+    if (static_cast<std::uint64_t>(st.st_size) == offset_) {
+        return 0;
+    }
+
+    std::vector<char> input(carry_);
+    const size_t carried = input.size();
+    input.resize(carried + (st.st_size - offset_));
+    size_t size = carried;
+    while (size < input.size()) {
+        const ssize_t n = ::pread(input_, input.data() + size, input.size() - size, static_cast<off_t>(offset_ + size - carried));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error("failed to read: " + input_path_.string() + ": " + std::strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+    }
+    input.resize(size);
+    const std::uint64_t appended = size - carried;
+    const bool head = offset_ == 0;
+    offset_ += appended;
+
+    // text that looked like ASCII so far gets its encoding from the first appended bytes that are not
+    if (!conversion_ || from_encoding_ == "ASCII") {
+        if (from_encoding_ == "ASCII" && native::ascii_prefix(input.data(), input.size()) != input.size()) {
+            from_encoding_ = detect_(input);
+            conversion_.reset();
+        }
+        if (!conversion_) {
+            conversion_ = backends_.open(to_encoding_, from_encoding_, unmappable_, input);
+            if (!conversion_) {
+                throw std::runtime_error("cannot convert " + input_path_.string() + " (" + from_encoding_ + ") to " + to_encoding_);
+            }
+        }
+    }
+
+    if (head) {
+        rewrite_(input, from_encoding_);
+    }
+
+    std::vector<char> output(std::max<size_t>(input.size() << 1, 16));
+    char *in_ptr = input.data();
+    size_t in_left = input.size();
+    size_t produced = 0;
+    while (in_left > 0) {
+        char *out_ptr = output.data() + produced;
+        size_t out_left = output.size() - produced;
+        const size_t result = conversion_->convert(&in_ptr, &in_left, &out_ptr, &out_left);
+        produced = output.size() - out_left;
+        if (result != static_cast<size_t>(-1)) {
+            break;
+        }
+        if (errno == E2BIG) {
+            output.resize(output.size() << 1);
+        } else if (errno == EINVAL) {
+            // the writer is in the middle of a character, the rest of it comes with the next update
+            break;
+        } else {
+            throw std::runtime_error("convert " + input_path_.string() + " (" + from_encoding_ + ") failed near offset " +
+                                     std::to_string(offset_ - in_left) + ": " + std::strerror(errno));
+        }
+    }
+    carry_.assign(in_ptr, in_ptr + in_left);
+
+    for (const char *data = output.data(); produced > 0;) {
+        const ssize_t n = ::write(output_, data, produced);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error("failed to write: " + output_path_.string() + ": " + std::strerror(errno));
+        }
+        data += n;
+        produced -= n;
+    }
+    return appended;
+}
@@ -0,0 +1,66 @@
+#ifndef FOLLOW_H
+#define FOLLOW_H
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+// Keeps the converted copy of a growing file up to date, like tail -f: each update converts only the bytes
+// appended since the previous one and appends them to the output. A multibyte sequence cut off at the end of the
+// file is carried over to the next update. If the file shrinks (truncated for rotation) it is converted again
+// from the start, which is also when the head of the file is passed to the rewrite. The input stays open, so a file renamed away by rotation is followed to its end.
+class follower_t
+{
+public:
+    // Detects the encoding of a buffer of the file's content
+    using detect_t = std::function<std::string(const std::vector<char> &)>;
+    // Adjusts the input read from the start of the file, in the given encoding, before it is converted
+    using rewrite_t = std::function<void(std::vector<char> &, const std::string &)>;
+
+    // `from_encoding` is the encoding detected so far; while it is ASCII, the appended text is detected again as
+    // soon as it contains other bytes. The output is created (or truncated) here. throws std::runtime_error
+    follower_t(backend_selector_t &backends,
+               const std::filesystem::path &input,
+               const std::filesystem::path &output,
+               const std::string &from_encoding,
+               const std::string &to_encoding,
+               native::unmappable_t unmappable,
+               detect_t detect,
+               rewrite_t rewrite);
+    ~follower_t();
+    follower_t(const follower_t &) = delete;
+    follower_t &operator=(const follower_t &) = delete;
+
+    // Convert what was appended since the last update; returns the number of input bytes read.
+    // throws std::runtime_error on I/O and conversion errors
+    std::uint64_t update();
+
+    const std::string &from_encoding() const
+    {
+        return from_encoding_;
+    }
+
+private:
+    void restart();
+
+    backend_selector_t &backends_;
+    std::filesystem::path input_path_;
+    std::filesystem::path output_path_;
+    std::string from_encoding_;
+    std::string to_encoding_;
+    native::unmappable_t unmappable_;
+    detect_t detect_;
+    rewrite_t rewrite_;
+    int input_ = -1;
+    int output_ = -1;
+    std::uint64_t offset_ = 0; // input read so far, including the carried bytes
+    std::vector<char> carry_; // incomplete sequence at the end of the input read so far
+    std::unique_ptr<conversion_t> conversion_;
+};
+
+#endif // FOLLOW_H
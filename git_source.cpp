@@ -0,0 +1,225 @@
+#include "git_source.h"
+
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace
+{
+// Start `args` with pipes to its stdin and from its stdout; `to_child` may be nullptr to leave stdin alone
+pid_t spawn(const std::vector<std::string> &args, int *to_child, int &from_child, bool quiet = false)
+{
+    int in[2] = {-1, -1};
+    int out[2];
+    if ((to_child != nullptr && pipe2(in, O_CLOEXEC) != 0) || pipe2(out, O_CLOEXEC) != 0) {
+        throw std::runtime_error(std::string("cannot create pipe: ") + std::strerror(errno));
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (to_child != nullptr) {
+        posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    if (quiet) {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+
+    std::vector<char *> argv;
+    for (const auto &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    const int error = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (to_child != nullptr) {
+        close(in[0]);
+    }
+    close(out[1]);
+    if (error != 0) {
+        if (to_child != nullptr) {
+            close(in[1]);
+        }
+        close(out[0]);
+        throw std::runtime_error("cannot run " + args[0] + ": " + std::strerror(error));
+    }
+    if (to_child != nullptr) {
+        *to_child = in[1];
+    }
+    from_child = out[0];
+    return pid;
+}
+
+bool exited_cleanly(pid_t pid)
+{
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// stdout of `args`, nullopt if it fails
+std::optional<std::string> capture(const std::vector<std::string> &args, bool quiet = false)
+{
+    int from_child;
+    const pid_t pid = spawn(args, nullptr, from_child, quiet);
+    std::string output;
+    char buffer[64 * 1024];
+    for (ssize_t n; (n = ::read(from_child, buffer, sizeof(buffer))) != 0;) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        output.append(buffer, n);
+    }
+    close(from_child);
+    if (!exited_cleanly(pid)) {
+        return std::nullopt;
+    }
+    return output;
+}
+
+// Holds back SIGPIPE in this thread while writing to a child that may have exited, so that the write fails with
+// EPIPE instead of killing chconv; a SIGPIPE raised meanwhile is discarded unless one was already pending
+class sigpipe_guard_t
+{
+public:
+    sigpipe_guard_t()
+    {
+        sigemptyset(&pipe_);
+        sigaddset(&pipe_, SIGPIPE);
+        sigset_t pending;
+        sigpending(&pending);
+        was_pending_ = sigismember(&pending, SIGPIPE) == 1;
+        pthread_sigmask(SIG_BLOCK, &pipe_, &old_);
+    }
+    ~sigpipe_guard_t()
+    {
+        if (!was_pending_) {
+            const timespec none{};
+            while (sigtimedwait(&pipe_, nullptr, &none) < 0 && errno == EINTR) {
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old_, nullptr);
+    }
+    sigpipe_guard_t(const sigpipe_guard_t &) = delete;
+    sigpipe_guard_t &operator=(const sigpipe_guard_t &) = delete;
+
+private:
+    sigset_t pipe_;
+    sigset_t old_;
+    bool was_pending_;
+};
+}
+
+git_source_t::git_source_t(const std::filesystem::path &repo, const std::string &rev, bool recursive)
+{
+    // git would take it for an option, of ls-tree as well as of show
+    if (rev.empty() || rev.front() == '-') {
+        throw std::runtime_error("invalid revision \"" + rev + "\" of git repository " + repo.string());
+    }
+    // -z keeps paths verbatim instead of C-quoting the non-ASCII ones
+    std::vector<std::string> ls_tree{"git", "-C", repo.string(), "ls-tree", "-z", "-l", "--full-tree"};
+    if (recursive) {
+        ls_tree.push_back("-r");
+    }
+    ls_tree.push_back("--");
+    ls_tree.push_back(rev);
+    const auto listing = capture(ls_tree);
+    if (!listing) {
+        throw std::runtime_error("cannot list revision " + rev + " of git repository " + repo.string());
+    }
+    const std::string &output = *listing;
+
+    // <mode> SP <type> SP <oid> SP+ <size> TAB <path> NUL
+    for (size_t begin = 0, end; (end = output.find('\0', begin)) != std::string::npos; begin = end + 1) {
+        const std::string_view record(output.data() + begin, end - begin);
+        const size_t tab = record.find('\t');
+        const size_t type = record.find(' ');
+        const size_t oid = record.find(' ', type + 1);
+        if (tab == std::string_view::npos || type == std::string_view::npos || oid == std::string_view::npos) {
+            continue;
+        }
+        if (record.substr(type + 1, oid - type - 1) != "blob" || record.substr(0, type) == "120000") {
+            continue;
+        }
+        const size_t size = record.find(' ', oid + 1);
+        if (size == std::string_view::npos || size > tab) {
+            continue;
+        }
+        entries_.push_back({std::string(record.substr(tab + 1)),
+                            std::string(record.substr(oid + 1, size - oid - 1)),
+                            std::strtoull(std::string(record.substr(size, tab - size)).c_str(), nullptr, 10),
+                            record.substr(0, type) == "100755" ? 0755u : 0644u});
+    }
+
+    // a tree-ish that is not a commit has no time, its files are dated at the epoch
+    if (const auto time = capture({"git", "-C", repo.string(), "show", "-s", "--format=%ct", rev + "^{commit}"}, true)) {
+        time_ = std::strtoll(time->c_str(), nullptr, 10);
+    }
+
+    int response;
+    pid_ = spawn({"git", "-C", repo.string(), "cat-file", "--batch"}, &request_, response);
+    response_ = fdopen(response, "rb");
+}
+
+git_source_t::~git_source_t()
+{
+    if (request_ >= 0) {
+        close(request_);
+    }
+    if (response_ != nullptr) {
+        fclose(response_);
+    }
+    if (pid_ > 0) {
+        exited_cleanly(pid_);
+    }
+}
+
+std::vector<char> git_source_t::read(const std::string &oid)
+{
+    std::lock_guard lck(mtx_);
+    const std::string request = oid + '\n';
+    {
+        const sigpipe_guard_t guard;
+        for (size_t written = 0; written < request.size();) {
+            const ssize_t n = ::write(request_, request.data() + written, request.size() - written);
+            if (n < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("git cat-file is gone: ") + std::strerror(errno));
+            }
+            written += n > 0 ? n : 0;
+        }
+    }
+
+    // <oid> SP <type> SP <size> LF <contents> LF, or <oid> SP missing LF
+    char header[256];
+    if (std::fgets(header, sizeof(header), response_) == nullptr) {
+        throw std::runtime_error("git cat-file is gone");
+    }
+    const char *type = std::strchr(header, ' ');
+    const char *size = type ? std::strchr(type + 1, ' ') : nullptr;
+    if (size == nullptr || std::strncmp(type + 1, "blob ", 5) != 0) {
+        throw std::runtime_error("git object " + oid + " is not a blob");
+    }
+    std::vector<char> content(std::strtoull(size + 1, nullptr, 10));
+    if (std::fread(content.data(), 1, content.size(), response_) != content.size() || std::fgetc(response_) != '\n') {
+        throw std::runtime_error("short read of git object " + oid);
+    }
+    return content;
+}
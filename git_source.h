@@ -0,0 +1,57 @@
+#ifndef GIT_SOURCE_H
+#define GIT_SOURCE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+// Files of a revision read straight from a git object database, without a checkout. The tree is listed once
+// with `git ls-tree` and blobs are streamed from a single `git cat-file --batch` child kept for the whole run.
+// throws std::runtime_error if git cannot be run or the revision does not exist
+class git_source_t
+{
+public:
+    struct entry_t
+    {
+        std::string path; // relative to the repository root, '/' separated
+        std::string oid;
+        std::uintmax_t size;
+        unsigned mode; // permission bits, 0755 for executables
+    };
+
+    // only the top level of the tree unless `recursive`; symlinks and submodules are left out
+    git_source_t(const std::filesystem::path &repo, const std::string &rev, bool recursive);
+    ~git_source_t();
+    git_source_t(const git_source_t &) = delete;
+    git_source_t &operator=(const git_source_t &) = delete;
+
+    const std::vector<entry_t> &entries() const
+    {
+        return entries_;
+    }
+
+    // commit time of the revision, 0 if it is not a commit
+    std::time_t time() const
+    {
+        return time_;
+    }
+
+    // Content of a blob. Safe to call from several threads, requests to the child are serialised.
+    std::vector<char> read(const std::string &oid);
+
+private:
+    std::vector<entry_t> entries_;
+    std::time_t time_ = 0;
+    std::mutex mtx_;
+    pid_t pid_ = -1;
+    int request_ = -1; // stdin of cat-file
+    FILE *response_ = nullptr; // stdout of cat-file
+};
+
+#endif // GIT_SOURCE_H
@@ -1,21 +1,45 @@
+#include <algorithm>
+#include <cctype>
+#include <csignal>
 #include <cstdarg>
 #include <cstring>
 #include <errno.h>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <future>
 #include <iostream>
 #include <execution>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <numeric>
 #include <optional>
 #include <regex>
 #include <sstream>
+#include <string_view>
 #include <syncstream>
+#include <thread>
 
 #include "cmdline.h"
+#include "backend.h"
+#include "detect.h"
+#include "direct_io.h"
+#include "editorconfig.h"
+#include "follow.h"
+#include "git_source.h"
 #include "incbin.h"
+#include "native_codec.h"
+#include "normalize.h"
+#include "output_check.h"
+#include "output_file.h"
+#include "simd.h"
+#include "tar_writer.h"
+#include "transcoding_reader.h"
 #include "version.h"
 #include <iconv.h>
 #include <magic.h>
+#include <sys/stat.h>
 #include <uchardet.h>
 
 namespace fs = std::filesystem;
@@ -23,6 +47,7 @@ namespace fs = std::filesystem;
 INCBIN(magic_database_buffer, "../misc/magic.mgc"); // MAGIC_MGC_FILE
 
 static std::atomic_uint64_t g_processed_files = 0;
+static std::unique_ptr<backend_selector_t> g_backends;
 
 template<typename Type, typename Ctor, typename Dtor>
 struct resource_guard_t
@@ -183,7 +208,7 @@ enum class processing_status {
 
 static const char *render_string(const char *fmt, ...)
 {
-    thread_local static char buf[64] = {0};
+    thread_local static char buf[256] = {0};
     va_list args;
     va_start(args, fmt);
     std::vsprintf(buf, fmt, args);
@@ -206,6 +231,85 @@ static std::vector<std::string> split_string(const std::string &str, char delimi
     return tokens;
 }
 
+// Digits only: std::stoull alone skips blanks, wraps negative numbers around and ignores what follows the number
+static std::optional<std::uintmax_t> parse_number(const std::string &str)
+{
+    if (str.empty() || !std::all_of(str.begin(), str.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        return std::nullopt;
+    }
+    try {
+        return std::stoull(str);
+    } catch (const std::exception &) {
+        return std::nullopt;
+    }
+}
+
+// "50M", "512K", "2G" or a plain number of bytes, binary multiples
+static std::optional<std::uintmax_t> parse_size(const std::string &str)
+{
+    // std::stoull skips blanks and wraps negative numbers around
+    if (str.empty() || !std::isdigit(static_cast<unsigned char>(str[0]))) {
+        return std::nullopt;
+    }
+    size_t end = 0;
+    std::uintmax_t size;
+    try {
+        size = std::stoull(str, &end);
+    } catch (const std::exception &) {
+        return std::nullopt;
+    }
+    std::string unit = str.substr(end);
+    std::transform(unit.begin(), unit.end(), unit.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+    for (const char *suffix : {"IB", "B"}) {
+        if (unit.size() > 1 && unit.ends_with(suffix)) {
+            unit.resize(unit.size() - std::strlen(suffix));
+            break;
+        }
+    }
+    static const std::map<std::string, int> shifts{{"", 0}, {"B", 0}, {"K", 10}, {"M", 20}, {"G", 30}, {"T", 40}};
+    const auto it = shifts.find(unit);
+    if (it == shifts.end() || size > (UINTMAX_MAX >> it->second)) {
+        return std::nullopt;
+    }
+    return size << it->second;
+}
+
+// An age like "30m", "12h", "7d" or "2w" before now, or a local date "2024-05-01" with an optional "12:30[:00]"
+static std::optional<std::chrono::system_clock::time_point> parse_time(const std::string &str)
+{
+    size_t end = 0;
+    long long count;
+    try {
+        count = std::stoll(str, &end);
+    } catch (const std::exception &) {
+        return std::nullopt;
+    }
+    static const std::map<std::string, std::chrono::seconds> units{{"s", std::chrono::seconds(1)}, {"m", std::chrono::minutes(1)}, {"h", std::chrono::hours(1)}, {"d", std::chrono::days(1)}, {"w", std::chrono::weeks(1)}};
+    if (const auto it = units.find(str.substr(end)); it != units.end()) {
+        return std::chrono::system_clock::now() - count * it->second;
+    }
+
+    for (const char *format : {"%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d"}) {
+        std::tm tm{};
+        std::istringstream ss(str);
+        ss >> std::get_time(&tm, format);
+        if (!ss.fail() && ss.peek() == std::char_traits<char>::eof()) {
+            tm.tm_isdst = -1;
+            return std::chrono::system_clock::from_time_t(std::mktime(&tm));
+        }
+    }
+    return std::nullopt;
+}
+
+static std::string backend_names()
+{
+    std::string names;
+    for (const auto *backend : available_backends()) {
+        names += std::string(", ") + backend->name();
+    }
+    return names;
+}
+
 using regex_pairs = std::pair<std::string, std::vector<std::regex>>;
 static bool parse_regex_pairs(const std::string &pattern, std::optional<regex_pairs> &pairs)
 {
@@ -222,6 +326,13 @@ static bool parse_regex_pairs(const std::string &pattern, std::optional<regex_pa
     return true;
 }
 
+// How the converted files of a directory are written
+enum class output_format_t {
+    files,
+    tar,
+    tar_gz,
+};
+
 static struct options
 {
     bool verbose = false;
@@ -232,9 +343,51 @@ static struct options
     std::optional<regex_pairs> suffix;
     std::optional<std::string> to;
     std::optional<regex_pairs> exclude;
+    native::unmappable_t unmappable = native::unmappable_t::fail;
+    std::string backend;
+    size_t dir_prior = 0; // 0 = detect every file independently
+    normalization_t normalize = normalization_t::none;
+    bool editorconfig_hint = false;
+    bool editorconfig_target = false;
+    bool convert_names = false;
+    bool follow = false;
+    checksum_t checksum = checksum_t::none;
+    fs::path checksum_file; // empty = next to the output
+    bool verify = false;
+    std::optional<std::regex> grep; // search the decoded text instead of converting
+    bool grep_paths = false; // matches are prefixed with the file path, for directory inputs
+    std::uintmax_t direct_io = 0; // size from which files bypass the page cache, 0 = never
+    output_format_t output_format = output_format_t::files;
+    // files outside these bounds are left out of the walk
+    std::optional<std::uintmax_t> min_size;
+    std::optional<std::uintmax_t> max_size;
+    std::optional<std::chrono::system_clock::time_point> newer_than;
+    std::optional<std::chrono::system_clock::time_point> older_than;
+    std::optional<std::pair<std::uint64_t, std::uint64_t>> slice; // offset and length in the converted text
+    std::optional<fs::path> git; // read the input from this repository instead of the filesystem
+    std::string rev;
 
     void init(int argc, char *argv[])
     {
+        // the SIMD level is part of the version string, so it has to be selected before the parser prints it
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            std::optional<std::string> level;
+            if (arg.starts_with("--simd=")) {
+                level = arg.substr(7);
+            } else if (arg == "--simd" && i + 1 < argc) {
+                level = argv[i + 1];
+            }
+            if (level) {
+                try {
+                    simd::select(*level);
+                } catch (const std::invalid_argument &ex) {
+                    std::cerr << "invalid --simd: " << ex.what() << '\n';
+                    std::exit(1);
+                }
+            }
+        }
+
         cmdline::g_config.show_option_typename = false;
         // clang-format off
         parser.program_name("chconv");
@@ -242,8 +395,19 @@ static struct options
         parser.flag("verbose", 'v', "print verbose output");
         parser.flag("recursive", 'r', "process directories recursively");
         parser.flag("dry-run", 'd', "just print files to be converted and do noting");
-        parser.option<std::string>("input", 'i', "input filename or directory", true);
-        parser.option<std::string>("output", 'o', "output filename or directory", true);
+        parser.flag("convert-names", '\0', "also convert the encoding of file and directory names under the input directory");
+        parser.flag("verify", '\0', "decode every output back while it is produced and check that it gives the input again");
+        parser.flag("follow", '\0', "keep running and append the conversion of whatever is appended to the input files, like tail -f");
+        parser.option<std::string>("input", 'i', "input filename or directory (required unless --git)", false);
+        parser.option<std::string>("output", 'o', "output filename or directory (required unless --grep)", false);
+        parser.option<std::string>("min-size", '\0', cmdline::description("skip files smaller than this in directories", "bytes, or with a K, M, G or T suffix"), false);
+        parser.option<std::string>("max-size", '\0', cmdline::description("skip files larger than this in directories", "bytes, or with a K, M, G or T suffix"), false);
+        parser.option<std::string>("newer-than", '\0', cmdline::description("only convert files in directories modified after this", "an age such as 30m, 12h, 7d or 2w, or a date such as 2024-05-01 [12:30]"), false);
+        parser.option<std::string>("older-than", '\0', cmdline::description("only convert files in directories modified before this", "an age such as 30m, 12h, 7d or 2w, or a date such as 2024-05-01 [12:30]"), false);
+        parser.option<std::string>("grep", '\0', cmdline::description("print the lines matching this regular expression instead of converting", "matched against the decoded text and printed in the output encoding; nothing is written"), false);
+        parser.option<std::string>("slice", '\0', cmdline::description("only write bytes OFFSET[:LENGTH] of the converted text of a single file", "through a seek index saved next to the input, so that later slices convert only their range"), false);
+        parser.option<std::string>("git", '\0', cmdline::description("read the input from a git repository instead of the filesystem", "blobs of --rev are streamed from the object database without a checkout"), false);
+        parser.option_with_default<std::string>("rev", '\0', "revision to read with --git", false, "HEAD");
         parser.option<std::string>("suffix", 's', cmdline::description("included file suffixes", "matched by regex or string and split by ';'"), false);
         parser.option<std::string>("exclude", 'e', cmdline::description("excluded filenames, suffixes or dirs", "matched by regex or string and split by ';'"), false);
         parser.option_with_default<std::string>("to", 't',
@@ -251,11 +415,22 @@ static struct options
                 "encoding of output file",
                 R"(see https://www.gnu.org/savannah-checkouts/gnu/libiconv/ for more information)"),
             false, "UTF-8");
-        parser.version(render_string("%s (libuchardet@%s, libiconv@%s, libmagic@%s)",
+        parser.option_with_default<std::string>("backend", '\0', cmdline::description("conversion backend", std::string("auto picks the fastest per encoding pair; available: auto") + backend_names()), false, "native");
+        parser.option<std::string>("direct-io", '\0', cmdline::description("convert files of at least this many MiB with O_DIRECT chunked I/O", "bypasses the page cache and never holds the whole file in memory"), false);
+        parser.option<std::string>("dir-prior", '\0', cmdline::description("learn the encoding of each directory from its first N files", "later files that decode cleanly in it skip detection"), false);
+        parser.option<std::string>("editorconfig", '\0', cmdline::description("use the charset of .editorconfig files", "hint: as detection result when the file decodes cleanly, target: as output encoding; or both as hint,target"), false);
+        parser.option_with_default<std::string>("simd", '\0', cmdline::description("instruction set of the vectorised kernels", "auto picks the widest one the CPU supports; scalar, sse4.2, avx2 or avx512"), false, "auto");
+        parser.option_with_default<std::string>("normalize", '\0', cmdline::description("Unicode normalization form of the output", "nfc, nfd or none"), false, "none");
+        parser.option_with_default<std::string>("output-format", '\0', cmdline::description("how converted directories are written", "files, or a single tar or tar.gz archive at the output path"), false, "files");
+        parser.option_with_default<std::string>("checksum", '\0', cmdline::description("hash every output while it is written into a checksum file", "sha256, xxh3 or none"), false, "none");
+        parser.option<std::string>("checksum-file", '\0', cmdline::description("where --checksum writes the checksums of the run", "defaults to the output path followed by .sha256 or .xxh3"), false);
+        parser.option_with_default<std::string>("unmappable", '\0', cmdline::description("characters the output encoding cannot represent", "fail, skip or substitute with '?'"), false, "fail");
+        parser.version(render_string("%s (libuchardet@%s, libiconv@%s, libmagic@%s)\nsimd: %s",
                                      CHCONV_VERSION,
                                      LIBCHARDET_VERSION,
                                      LIBICONV_VERSION,
-                                     LIBMAGIC_VERSION));
+                                     LIBMAGIC_VERSION,
+                                     simd::name(simd::selected())));
         // clang-format on
         parser.parse_check(argc, argv);
 
@@ -263,9 +438,32 @@ static struct options
         verbose = parser.exist("verbose");
         recursive = parser.exist("recursive");
         dry_run = parser.exist("dry-run");
+        convert_names = parser.exist("convert-names");
+        follow = parser.exist("follow");
+        verify = parser.exist("verify");
         // required options
-        input = parser.get<std::string>("input");
-        output = parser.get<std::string>("output");
+        if (parser.exist("git")) {
+            git = parser.get<std::string>("git");
+            input = *git;
+        } else if (parser.exist("input")) {
+            input = parser.get<std::string>("input");
+        } else {
+            std::cerr << "need option: --input\n";
+            std::exit(1);
+        }
+        if (parser.exist("grep")) {
+            try {
+                grep = std::regex(parser.get<std::string>("grep"));
+            } catch (const std::regex_error &ex) {
+                std::cerr << "invalid --grep: " << parser.get<std::string>("grep") << ", " << ex.what() << '\n';
+                std::exit(1);
+            }
+        } else if (parser.exist("output")) {
+            output = parser.get<std::string>("output");
+        } else {
+            std::cerr << "need option: --output\n";
+            std::exit(1);
+        }
         // optional options
         if (parser.exist("suffix")) {
             if (!parse_regex_pairs(parser.get<std::string>("suffix"), suffix)) {
@@ -277,8 +475,156 @@ static struct options
                 std::exit(1);
             }
         }
+        if (parser.exist("dir-prior")) {
+            const std::string dir_prior_str = parser.get<std::string>("dir-prior");
+            const auto files = parse_number(dir_prior_str);
+            if (!files || *files > std::numeric_limits<size_t>::max()) {
+                std::cerr << "invalid --dir-prior: " << dir_prior_str << ", expected a number of files\n";
+                std::exit(1);
+            }
+            dir_prior = static_cast<size_t>(*files);
+        }
+        if (parser.exist("direct-io")) {
+            const std::string direct_io_str = parser.get<std::string>("direct-io");
+            const auto mebibytes = parse_number(direct_io_str);
+            if (!mebibytes || *mebibytes > (UINTMAX_MAX >> 20)) {
+                std::cerr << "invalid --direct-io: " << direct_io_str << ", expected a size in MiB\n";
+                std::exit(1);
+            }
+            direct_io = *mebibytes << 20;
+        }
+        for (const auto &[name, size] : {std::pair{"min-size", &min_size}, std::pair{"max-size", &max_size}}) {
+            if (parser.exist(name)) {
+                *size = parse_size(parser.get<std::string>(name));
+                if (!*size) {
+                    std::cerr << "invalid --" << name << ": " << parser.get<std::string>(name) << ", expected a size such as 4096, 512K or 50M\n";
+                    std::exit(1);
+                }
+            }
+        }
+        for (const auto &[name, time] : {std::pair{"newer-than", &newer_than}, std::pair{"older-than", &older_than}}) {
+            if (parser.exist(name)) {
+                *time = parse_time(parser.get<std::string>(name));
+                if (!*time) {
+                    std::cerr << "invalid --" << name << ": " << parser.get<std::string>(name) << ", expected an age such as 7d or a date such as 2024-05-01\n";
+                    std::exit(1);
+                }
+            }
+        }
+        if (parser.exist("slice")) {
+            const std::string slice_str = parser.get<std::string>("slice");
+            const size_t colon = slice_str.find(':');
+            try {
+                size_t end;
+                const std::uint64_t offset = std::stoull(slice_str.substr(0, colon), &end);
+                std::uint64_t length = std::numeric_limits<std::uint64_t>::max();
+                if (end != colon && end != slice_str.size()) {
+                    throw std::invalid_argument(slice_str);
+                }
+                if (colon != std::string::npos) {
+                    length = std::stoull(slice_str.substr(colon + 1), &end);
+                    if (end != slice_str.size() - colon - 1) {
+                        throw std::invalid_argument(slice_str);
+                    }
+                }
+                slice.emplace(offset, length);
+            } catch (const std::exception &) {
+                std::cerr << "invalid --slice: " << slice_str << ", expected OFFSET or OFFSET:LENGTH in bytes\n";
+                std::exit(1);
+            }
+        }
+        if (parser.exist("editorconfig")) {
+            for (const auto &use : split_string(parser.get<std::string>("editorconfig"), ',')) {
+                if (use == "hint") {
+                    editorconfig_hint = true;
+                } else if (use == "target") {
+                    editorconfig_target = true;
+                } else {
+                    std::cerr << "invalid --editorconfig: " << use << ", expected hint, target or hint,target\n";
+                    std::exit(1);
+                }
+            }
+        }
         // options with default value
         to = parser.get<std::string>("to");
+        rev = parser.get<std::string>("rev");
+        backend = parser.get<std::string>("backend");
+        const std::string normalize_str = parser.get<std::string>("normalize");
+        if (normalize_str == "nfc") {
+            normalize = normalization_t::nfc;
+        } else if (normalize_str == "nfd") {
+            normalize = normalization_t::nfd;
+        } else if (normalize_str != "none") {
+            std::cerr << "invalid --normalize: " << normalize_str << ", expected nfc, nfd or none\n";
+            std::exit(1);
+        }
+        if (normalize != normalization_t::none && !normalization_available()) {
+            std::cerr << "--normalize requires chconv to be built with ICU (WITH_ICU_BACKEND)\n";
+            std::exit(1);
+        }
+        const std::string output_format_str = parser.get<std::string>("output-format");
+        if (output_format_str == "tar") {
+            output_format = output_format_t::tar;
+        } else if (output_format_str == "tar.gz") {
+            output_format = output_format_t::tar_gz;
+        } else if (output_format_str != "files") {
+            std::cerr << "invalid --output-format: " << output_format_str << ", expected files, tar or tar.gz\n";
+            std::exit(1);
+        }
+        if (output_format == output_format_t::tar_gz && !tar_writer_t::gzip_available()) {
+            std::cerr << "--output-format tar.gz requires chconv to be built with zlib (WITH_ZLIB)\n";
+            std::exit(1);
+        }
+        const std::string checksum_str = parser.get<std::string>("checksum");
+        if (checksum_str == "sha256") {
+            checksum = checksum_t::sha256;
+        } else if (checksum_str == "xxh3") {
+            checksum = checksum_t::xxh3;
+        } else if (checksum_str != "none") {
+            std::cerr << "invalid --checksum: " << checksum_str << ", expected sha256, xxh3 or none\n";
+            std::exit(1);
+        }
+        if (!checksum_available(checksum)) {
+            std::cerr << "--checksum " << checksum_str << " requires chconv to be built with " << (checksum == checksum_t::sha256 ? "OpenSSL (WITH_OPENSSL)" : "xxHash (WITH_XXHASH)") << '\n';
+            std::exit(1);
+        }
+        if (parser.exist("checksum-file")) {
+            checksum_file = parser.get<std::string>("checksum-file");
+        }
+        const std::string unmappable_str = parser.get<std::string>("unmappable");
+        if (unmappable_str == "skip") {
+            unmappable = native::unmappable_t::skip;
+        } else if (unmappable_str == "substitute") {
+            unmappable = native::unmappable_t::substitute;
+        } else if (unmappable_str != "fail") {
+            std::cerr << "invalid --unmappable: " << unmappable_str << ", expected fail, skip or substitute\n";
+            std::exit(1);
+        }
+        // conflicting options, checked once all of them are parsed
+        if (grep && (git || slice || follow || output_format != output_format_t::files)) {
+            std::cerr << "--grep cannot be combined with --git, --slice, --follow or --output-format tar\n";
+            std::exit(1);
+        }
+        if (follow && (git || slice || output_format != output_format_t::files || normalize != normalization_t::none)) {
+            std::cerr << "--follow cannot be combined with --git, --slice, --output-format tar or --normalize\n";
+            std::exit(1);
+        }
+        if (git && (newer_than || older_than)) {
+            std::cerr << "--newer-than and --older-than do not apply to --git, blobs carry no modification time\n";
+            std::exit(1);
+        }
+        if ((checksum != checksum_t::none || verify) && (grep || follow || slice)) {
+            std::cerr << "--checksum and --verify cannot be combined with --grep, --follow or --slice\n";
+            std::exit(1);
+        }
+        if (slice && normalize != normalization_t::none) {
+            std::cerr << "--slice cannot be combined with --normalize, the offsets index the text before normalization\n";
+            std::exit(1);
+        }
+        if (verify && normalize != normalization_t::none) {
+            std::cerr << "--verify cannot be combined with --normalize, normalized text does not decode back to the input\n";
+            std::exit(1);
+        }
     }
 
 private:
@@ -350,6 +696,34 @@ static bool should_exclude(const fs::path &path)
     return false;
 }
 
+static bool has_walk_filters()
+{
+    return g.min_size || g.max_size || g.newer_than || g.older_than;
+}
+
+static bool should_include_size(std::uintmax_t size)
+{
+    return (!g.min_size || size >= *g.min_size) && (!g.max_size || size <= *g.max_size);
+}
+
+// Whether a file found by the directory walk passes the size and mtime filters. Its metadata is fetched by a single
+// stat(2) here, so that files which are filtered out are never opened.
+static bool should_include_entry(const fs::directory_entry &entry)
+{
+    if (!has_walk_filters()) {
+        return true;
+    }
+    struct stat st;
+    if (::stat(entry.path().c_str(), &st) != 0) {
+        return false;
+    }
+    const auto mtime = std::chrono::system_clock::from_time_t(st.st_mtim.tv_sec) +
+                       std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(st.st_mtim.tv_nsec));
+    return should_include_size(static_cast<std::uintmax_t>(st.st_size)) &&
+           (!g.newer_than || mtime > *g.newer_than) &&
+           (!g.older_than || mtime < *g.older_than);
+}
+
 static bool should_include_suffix(const fs::path &filepath)
 {
     // if no suffix specified, include all files
@@ -381,8 +755,21 @@ static bool should_include_suffix(const fs::path &filepath)
     return false;
 }
 
+// Leading bytes used to recognise BOM-less UTF-16/32
+static constexpr size_t wide_unicode_probe = 64 * 1024;
+
 static bool is_text_file(const fs::path &filepath)
 {
+    // libmagic reports BOM-less UTF-16/32 as binary data, so look for their NUL patterns first
+    if (std::ifstream file(filepath, std::ios::binary); file.is_open()) {
+        char head[wide_unicode_probe];
+        file.read(head, sizeof(head));
+        const size_t size = file.gcount();
+        if (size % 2 == 0 && detect::wide_unicode(head, size) != nullptr) {
+            return true;
+        }
+    }
+
     thread_local static magic_guard_t magic(MAGIC_MIME_TYPE);
     const char *mime_type = magic_file(magic, filepath.string().c_str());
     if (mime_type == nullptr) {
@@ -391,6 +778,113 @@ static bool is_text_file(const fs::path &filepath)
     return std::string(mime_type).find("text") != std::string::npos;
 }
 
+static bool is_text_buffer(const std::vector<char> &buffer)
+{
+    if (buffer.size() % 2 == 0 && detect::wide_unicode(buffer.data(), std::min(buffer.size(), wide_unicode_probe)) != nullptr) {
+        return true;
+    }
+
+    thread_local static magic_guard_t magic(MAGIC_MIME_TYPE);
+    const char *mime_type = magic_buffer(magic, buffer.data(), buffer.size());
+    if (mime_type == nullptr) {
+        throw std::runtime_error("failed to detect mime type: " + std::string(magic_error(magic)));
+    }
+    return std::string(mime_type).find("text") != std::string::npos;
+}
+
+// Dominant encoding of each directory, learned from the detection results of its first files.
+// Encodings that are told apart by their BOM are not learned, since a strict decode cannot check them.
+class directory_prior_t
+{
+public:
+    std::optional<std::string> get(const fs::path &dir)
+    {
+        std::lock_guard lck(mtx_);
+        const auto it = dirs_.find(dir);
+        if (it == dirs_.end()) {
+            return std::nullopt;
+        }
+        return it->second.encoding;
+    }
+
+    void vote(const fs::path &dir, const std::string &encoding)
+    {
+        if (encoding == "ASCII" || encoding.starts_with("UTF-16") || encoding.starts_with("UTF-32")) {
+            return;
+        }
+        std::lock_guard lck(mtx_);
+        entry_t &entry = dirs_[dir];
+        if (entry.encoding || entry.samples >= g.dir_prior) {
+            return;
+        }
+        ++entry.votes[encoding];
+        if (++entry.samples < g.dir_prior) {
+            return;
+        }
+        // strict majority of the samples, otherwise the directory is mixed and keeps being detected per file
+        for (const auto &[name, count] : entry.votes) {
+            if (count * 2 > entry.samples) {
+                entry.encoding = name;
+                if (g.verbose) {
+                    std::osyncstream(std::cout) << "directory " << dir << " learned encoding " << name << '\n';
+                }
+            }
+        }
+    }
+
+private:
+    struct entry_t
+    {
+        size_t samples = 0;
+        std::map<std::string, size_t> votes;
+        std::optional<std::string> encoding;
+    };
+    std::mutex mtx_;
+    std::map<fs::path, entry_t> dirs_;
+};
+
+static directory_prior_t g_directory_prior;
+static editorconfig_t g_editorconfig;
+
+// Whether the whole buffer decodes without error as `encoding`, to confirm a guess that did not come from uchardet.
+// A BOM or well-formed non-ASCII UTF-8 is left to uchardet, since legacy multibyte encodings accept most of those too.
+static bool decodes_strictly(const std::vector<char> &buffer, const std::string &encoding)
+{
+    const size_t ascii = native::ascii_prefix(buffer.data(), buffer.size());
+    if (ascii == buffer.size()) {
+        return false; // let uchardet report ASCII as before
+    }
+    if ((buffer.size() >= 2 && (std::memcmp(buffer.data(), "\xFF\xFE", 2) == 0 || std::memcmp(buffer.data(), "\xFE\xFF", 2) == 0)) ||
+        (buffer.size() >= 3 && std::memcmp(buffer.data(), "\xEF\xBB\xBF", 3) == 0)) {
+        return false;
+    }
+    const bool is_utf8 = ascii + native::utf8_prefix(buffer.data() + ascii, buffer.size() - ascii) == buffer.size();
+    if (encoding == "UTF-8" || is_utf8) {
+        return encoding == "UTF-8" && is_utf8;
+    }
+
+    auto conversion = g_backends->open("UTF-8", encoding, native::unmappable_t::fail, buffer);
+    if (!conversion) {
+        return false;
+    }
+    char scratch[64 * 1024];
+    char *in_ptr = const_cast<char *>(buffer.data()) + ascii;
+    size_t in_left = buffer.size() - ascii;
+    while (in_left > 0) {
+        char *out_ptr = scratch;
+        size_t out_left = sizeof(scratch);
+        if (conversion->convert(&in_ptr, &in_left, &out_ptr, &out_left) != (size_t)-1) {
+            break;
+        }
+        if (errno != E2BIG) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string detect_encoding(const fs::path &filename, const std::vector<char> &buffer, size_t size);
+
 static std::string detect_encoding(const fs::path &filename)
 {
     std::ifstream file(filename, std::ios::binary | std::ios::ate);
@@ -402,11 +896,54 @@ static std::string detect_encoding(const fs::path &filename)
     if (size <= 0) {
         return "empty file";
     }
-    file.seekg(0, std::ios::beg);
+    std::vector<char> buffer;
+    if (static_cast<size_t>(size) > detect::sample_threshold) {
+        // detection cost of huge files is bounded by sampling windows spread over the whole file
+        file.close();
+        buffer = detect::sample_file(filename, size);
+    } else {
+        file.seekg(0, std::ios::beg);
+        buffer.resize(size);
+        if (!file.read(buffer.data(), size)) {
+            throw std::runtime_error("failed to read: " + filename.string());
+        }
+    }
+    return detect_encoding(filename, buffer, size);
+}
 
-    std::vector<char> buffer(size);
-    if (!file.read(buffer.data(), size)) {
-        throw std::runtime_error("failed to read: " + filename.string());
+// Encoding of `buffer`, the content of `filename` or a sample of it when it is larger than the buffer
+static std::string detect_encoding(const fs::path &filename, const std::vector<char> &buffer, size_t size)
+{
+    if (size == 0) {
+        return "empty file";
+    }
+    if (size % 2 == 0) {
+        if (const char *wide = detect::wide_unicode(buffer.data(), std::min(buffer.size(), wide_unicode_probe))) {
+            return wide;
+        }
+    }
+
+    // a charset declared by the file itself is trusted as long as the content agrees with it
+    if (const auto declaration = detect::find_declaration(buffer.data(), buffer.size());
+        declaration && decodes_strictly(buffer, declaration->charset)) {
+        return declaration->charset;
+    }
+
+    if (g.editorconfig_hint) {
+        auto charset = g_editorconfig.charset(filename);
+        if (charset == editorconfig_t::utf8_bom) {
+            charset = "UTF-8"; // the BOM itself is recognised by uchardet
+        }
+        if (charset && decodes_strictly(buffer, *charset)) {
+            return *charset;
+        }
+    }
+
+    const fs::path dir = filename.parent_path();
+    if (g.dir_prior > 0) {
+        if (const auto prior = g_directory_prior.get(dir); prior && decodes_strictly(buffer, *prior)) {
+            return *prior;
+        }
     }
 
     // NOTE uchardet_reset的调用会修改uchardet_get_charset返回的字符串地址，
@@ -414,30 +951,206 @@ static std::string detect_encoding(const fs::path &filename)
     // 因此将uchardet_reset放到最前面调用
     thread_local static uchardet_guard_t cd;
     uchardet_reset(cd);
-    uchardet_handle_data(cd, buffer.data(), buffer.size());
+    // ASCII carries no signal to tell legacy encodings apart, so only the neighbourhoods of non-ASCII bytes are fed
+    const auto windows = detect::non_ascii_windows(buffer.data(), buffer.size());
+    if (windows.empty()) {
+        uchardet_handle_data(cd, buffer.data(), buffer.size());
+    }
+    for (const auto &window : windows) {
+        uchardet_handle_data(cd, buffer.data() + window.begin, window.end - window.begin);
+        if (buffer[window.end - 1] != '\n') {
+            uchardet_handle_data(cd, "\n", 1);
+        }
+    }
     uchardet_data_end(cd);
 
     const char *encoding = uchardet_get_charset(cd);
     if (std::strcmp(encoding, "") == 0) {
         throw std::runtime_error("unrecognized encoding of file: " + filename.string());
     }
+    if (g.dir_prior > 0) {
+        g_directory_prior.vote(dir, encoding);
+    }
     return encoding;
 }
 
+// Run a conversion over the whole input, growing the output buffer on E2BIG.
+// On failure errno is left as reported by the backend.
+// The output is a std::vector<char> or a mapped_output_t, both resized the same way.
+template<typename Buffer>
+static bool transcode(conversion_t &conversion, std::vector<char> &input_buffer, Buffer &output_buffer)
+{
+    // NOTE 分配输出缓冲区 (通常比输入大一些，因为编码可能扩充)
+    output_buffer.resize(std::max<size_t>(input_buffer.size() << 1, 16));
+
+    char *in_ptr = input_buffer.data();
+    size_t in_left = input_buffer.size();
+    size_t produced = 0;
+    // the second pass without input ends it, returning a stateful output encoding to its initial state
+    for (int pass = 0; pass < 2; ++pass) {
+        while (true) {
+            char *out_ptr = output_buffer.data() + produced;
+            size_t out_left = output_buffer.size() - produced;
+            const size_t result = conversion.convert(&in_ptr, &in_left, &out_ptr, &out_left);
+            produced = output_buffer.size() - out_left;
+            if (result != (size_t)-1) {
+                break;
+            }
+            if (errno != E2BIG) {
+                return false;
+            }
+            output_buffer.resize(output_buffer.size() << 1);
+        }
+        in_ptr = nullptr;
+    }
+    output_buffer.resize(produced);
+    return true;
+}
+
+// Point a charset declaration at the output encoding, keeping the case it was written in. Declarations are ASCII and
+// only found in ASCII compatible text, so this is done on the input and the conversion carries it over unchanged.
+// Only a declaration of `from_encoding` is rewritten, anything else is left as it was written.
+static void rewrite_declaration(std::vector<char> &input_buffer, const std::string &from_encoding, const std::string &to_encoding)
+{
+    const auto declaration = detect::find_declaration(input_buffer.data(), input_buffer.size(), from_encoding);
+    if (!declaration) {
+        return;
+    }
+    const std::string name = detect::declared_name(*declaration, input_buffer.data(), to_encoding);
+    input_buffer.erase(input_buffer.begin() + declaration->begin, input_buffer.begin() + declaration->end);
+    input_buffer.insert(input_buffer.begin() + declaration->begin, name.begin(), name.end());
+}
+
+// Outputs from this size on are written through a mapping, below it the mapping costs more than the copy it saves
+static constexpr size_t mapped_output_threshold = 1024 * 1024;
+
+static bool is_utf8_name(const std::string &encoding)
+{
+    std::string upper(encoding);
+    std::transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return std::toupper(c); });
+    return upper == "UTF-8" || upper == "UTF8";
+}
+
+// Bytes to skip when converting `from_encoding` to `to_encoding` only drops a BOM (or nothing at all for the same
+// encoding), e.g. UTF-16 with a little endian BOM to UTF-16LE. nullopt if the conversion really changes the text.
+static std::optional<size_t> passthrough_offset(const fs::path &input_filename, const std::string &from_encoding, const std::string &to_encoding)
+{
+    if (from_encoding == to_encoding) {
+        return 0;
+    }
+    const bool utf16 = from_encoding == "UTF-16";
+    if (!utf16 && from_encoding != "UTF-32") {
+        return std::nullopt;
+    }
+    char bom[4] = {};
+    std::ifstream(input_filename, std::ios::binary).read(bom, sizeof(bom));
+    const bool little = utf16 ? std::memcmp(bom, "\xFF\xFE", 2) == 0 : std::memcmp(bom, "\xFF\xFE\0\0", 4) == 0;
+    const bool big = utf16 ? std::memcmp(bom, "\xFE\xFF", 2) == 0 : std::memcmp(bom, "\0\0\xFE\xFF", 4) == 0;
+    if ((little && to_encoding == from_encoding + "LE") || (big && to_encoding == from_encoding + "BE")) {
+        return utf16 ? 2 : 4;
+    }
+    return std::nullopt;
+}
+
+// Checksums and round-trip results of the outputs of this run, collected from all workers and written as one file
+// in the format of sha256sum/xxhsum, sorted by path. Failed round trips are reported at once and noted as comments.
+class checksum_log_t
+{
+public:
+    void record(const fs::path &output, const std::string &digest, std::optional<bool> verified)
+    {
+        if (verified == false) {
+            std::osyncstream(std::cerr) << "round trip failed: " << output << '\n';
+        }
+        const fs::path name = output == g.output ? output.filename() : output.lexically_normal().lexically_relative(g.output.lexically_normal());
+        std::lock_guard lck(mtx_);
+        entries_.push_back({name.generic_string(), digest, verified});
+    }
+
+    bool failed() const
+    {
+        return std::any_of(entries_.begin(), entries_.end(), [](const entry_t &entry) { return entry.verified == false; });
+    }
+
+    // throws std::runtime_error
+    void write(const fs::path &path)
+    {
+        std::sort(entries_.begin(), entries_.end(), [](const entry_t &a, const entry_t &b) { return a.name < b.name; });
+        std::string text;
+        for (const auto &entry : entries_) {
+            text += entry.digest + "  " + entry.name + '\n';
+            if (entry.verified == false) {
+                text += "# round trip failed: " + entry.name + '\n';
+            }
+        }
+        write_output(path, text.data(), text.size());
+    }
+
+private:
+    struct entry_t
+    {
+        std::string name;
+        std::string digest;
+        std::optional<bool> verified;
+    };
+
+    std::mutex mtx_;
+    std::vector<entry_t> entries_;
+};
+
+static checksum_log_t g_checksums;
+
+// nullptr unless outputs are hashed or verified; throws std::runtime_error if the output cannot be decoded back
+static std::unique_ptr<output_check_t> make_output_check(const std::string &from_encoding, const std::string &to_encoding)
+{
+    if (g.checksum == checksum_t::none && !g.verify) {
+        return nullptr;
+    }
+    std::unique_ptr<conversion_t> reverse;
+    if (g.verify) {
+        reverse = g_backends->open(from_encoding, to_encoding, native::unmappable_t::fail, {});
+        if (!reverse) {
+            throw std::runtime_error("cannot verify, no conversion from " + to_encoding + " back to " + from_encoding);
+        }
+    }
+    return std::make_unique<output_check_t>(g.checksum, std::move(reverse));
+}
+
+static bool convert_buffer(std::vector<char> &input_buffer,
+                           const fs::path &input_filename,
+                           const std::string &from_encoding,
+                           const fs::path &output_filename,
+                           const std::string &to_encoding,
+                           std::vector<char> *sink,
+                           output_check_t *check);
+
+// With a `sink` the converted text is left there instead of being written to `output_filename`
 static bool convert_encoding(const fs::path &input_filename,
                              const std::string &from_encoding,
                              const fs::path &output_filename,
-                             const std::string &to_encoding)
+                             const std::string &to_encoding,
+                             std::vector<char> *sink = nullptr)
 {
     std::osyncstream serr(std::cerr);
+    // hashing and verifying need the bytes in memory, which the copies inside the kernel never bring there
+    const std::unique_ptr<output_check_t> check = make_output_check(from_encoding, to_encoding);
+
+    // text that passes through unchanged goes from the input file to a pipe inside the kernel
+    if (sink == nullptr && !check && g.normalize == normalization_t::none && is_pipe(output_filename)) {
+        if (const auto offset = passthrough_offset(input_filename, from_encoding, to_encoding)) {
+            if (splice_to_pipe(input_filename, *offset, output_filename)) {
+                return true;
+            }
+        }
+    }
 
     // 如果源编码和目标编码相同，则直接复制文件
-    if (from_encoding == to_encoding) {
+    if (sink == nullptr && !check && from_encoding == to_encoding && g.normalize == normalization_t::none) {
         try {
             if (input_filename != output_filename)
-                fs::copy_file(input_filename, output_filename, fs::copy_options::overwrite_existing);
+                copy_output(input_filename, output_filename);
             return true;
-        } catch (const fs::filesystem_error& ex) {
+        } catch (const std::exception &ex) {
             serr << "copy " << input_filename << "(" << from_encoding << ") -> " << output_filename << "(" << to_encoding << ") failed: " << ex.what() << '\n';
             return false;
         }
@@ -449,6 +1162,37 @@ static bool convert_encoding(const fs::path &input_filename,
         return false;
     }
 
+    if (sink == nullptr && g.direct_io > 0 && g.normalize == normalization_t::none && fs::file_size(input_filename) >= g.direct_io) {
+        // the head is enough for calibrating the backend, the rest is streamed
+        std::vector<char> sample(256 * 1024);
+        input_file.read(sample.data(), sample.size());
+        sample.resize(input_file.gcount());
+        input_file.close();
+        auto conversion = g_backends->open(to_encoding, from_encoding, g.unmappable, sample);
+        if (!conversion) {
+            serr << "cannot convert " << input_filename << "(" << from_encoding << ") -> " << output_filename << "(" << to_encoding << "): " << std::strerror(errno) << "(" << errno << ")\n";
+            return false;
+        }
+        std::optional<bool> done;
+        try {
+            done = direct_transcode(*conversion, input_filename, output_filename, from_encoding, to_encoding, check.get());
+        } catch (const std::exception &) {
+            fs::remove(output_filename);
+            throw;
+        }
+        if (done) {
+            if (!*done) {
+                serr << "convert " << input_filename << "(" << from_encoding << ") -> " << output_filename << "(" << to_encoding << ") failed: " << std::strerror(errno) << "(" << errno << ")\n";
+                fs::remove(output_filename);
+            } else if (check) {
+                g_checksums.record(output_filename, check->digest(), check->verified());
+            }
+            return *done;
+        }
+        // no O_DIRECT on this filesystem, fall back to the buffered path
+        input_file.open(input_filename, std::ios::binary);
+    }
+
     input_file.seekg(0, std::ios::end);
     const std::streamsize size = input_file.tellg();
 
@@ -458,42 +1202,313 @@ static bool convert_encoding(const fs::path &input_filename,
         serr << "failed to read: " << input_filename << '\n';
         return false;
     }
-
-    iconv_t cd = iconv_open(to_encoding.c_str(), from_encoding.c_str());
-    if (cd == (iconv_t)-1) {
-        serr << "cannot convert " << input_filename << "(" << from_encoding << ") -> " << output_filename << "(" << to_encoding << "): " << std::strerror(errno) << "(" << errno << ")\n";
+    if (!convert_buffer(input_buffer, input_filename, from_encoding, output_filename, to_encoding, sink, check.get())) {
         return false;
     }
+    if (check) {
+        g_checksums.record(output_filename, check->digest(), check->verified());
+    }
+    return true;
+}
+
+// Convert the content of `input_filename` held in `input_buffer`, which is consumed. `check`, if given, is fed
+// the converted text and the output.
+static bool convert_buffer(std::vector<char> &input_buffer,
+                           const fs::path &input_filename,
+                           const std::string &from_encoding,
+                           const fs::path &output_filename,
+                           const std::string &to_encoding,
+                           std::vector<char> *sink,
+                           output_check_t *check)
+{
+    std::osyncstream serr(std::cerr);
+
+    const auto convert_step = [&](const std::string &from, const std::string &to, std::vector<char> &input, auto &output) {
+        auto conversion = g_backends->open(to, from, g.unmappable, input);
+        if (!conversion) {
+            serr << "cannot convert " << input_filename << "(" << from << ") -> " << output_filename << "(" << to << "): " << std::strerror(errno) << "(" << errno << ")\n";
+            return false;
+        }
+        if (!transcode(*conversion, input, output)) {
+            serr << "convert " << input_filename << "(" << from << ") -> " << output_filename << "(" << to << ") failed: " << std::strerror(errno) << "(" << errno << ")\n";
+            return false;
+        }
+        return true;
+    };
+
+    // only reached for a sink or a check, plain copies never read the file
+    const bool passthrough = from_encoding == to_encoding && g.normalize == normalization_t::none;
+    std::vector<char> output_buffer;
+    if (passthrough) {
+        output_buffer = std::move(input_buffer);
+        if (check != nullptr) {
+            check->input(output_buffer.data(), output_buffer.size());
+        }
+    } else {
+        rewrite_declaration(input_buffer, from_encoding, to_encoding);
+        if (check != nullptr) {
+            check->input(input_buffer.data(), input_buffer.size());
+        }
+    }
 
-    // NOTE 分配输出缓冲区 (通常比输入大一些，因为编码可能扩充)
-    size_t output_buffer_size = input_buffer.size() << 1;
-    std::vector<char> output_buffer(output_buffer_size);
+    // converters write straight into the mapped output file when nothing else has to touch the text afterwards
+    if (sink == nullptr && !passthrough && g.normalize == normalization_t::none && input_buffer.size() >= mapped_output_threshold) {
+        if (auto mapped = mapped_output_t::open(output_filename, input_buffer.size() << 1)) {
+            if (convert_step(from_encoding, to_encoding, input_buffer, *mapped)) {
+                if (check != nullptr) {
+                    check->output(mapped->data(), mapped->size());
+                }
+                mapped->commit();
+                return true;
+            }
+            mapped.reset();
+            fs::remove(output_filename);
+            return false;
+        }
+    }
 
-    char *in_ptr = input_buffer.data();
-    size_t in_left = input_buffer.size();
-    char *out_ptr = output_buffer.data();
-    size_t out_left = output_buffer_size;
+    if (passthrough) {
+        // already in output_buffer
+    } else if (g.normalize == normalization_t::none) {
+        if (!convert_step(from_encoding, to_encoding, input_buffer, output_buffer)) {
+            return false;
+        }
+    } else {
+        // normalization works on the decoded text, so the conversion goes through UTF-8
+        std::vector<char> text;
+        if (is_utf8_name(from_encoding) || from_encoding == "ASCII") {
+            text = std::move(input_buffer);
+        } else if (!convert_step(from_encoding, "UTF-8", input_buffer, text)) {
+            return false;
+        }
+        normalize_utf8(text, g.normalize);
+        if (is_utf8_name(to_encoding)) {
+            output_buffer = std::move(text);
+        } else if (!convert_step("UTF-8", to_encoding, text, output_buffer)) {
+            return false;
+        }
+    }
 
-    size_t result = iconv(cd, &in_ptr, &in_left, &out_ptr, &out_left);
-    if (result == (size_t)-1) {
-        serr << "convert " << input_filename << "(" << from_encoding << ") -> " << output_filename << "(" << to_encoding << ") failed: " << std::strerror(errno) << "(" << errno << ")\n";
-        iconv_close(cd);
+    if (check != nullptr) {
+        check->output(output_buffer.data(), output_buffer.size());
+    }
+    if (sink != nullptr) {
+        *sink = std::move(output_buffer);
+        return true;
+    }
+
+    try {
+        write_output(output_filename, output_buffer.data(), output_buffer.size());
+    } catch (const std::exception &ex) {
+        serr << ex.what() << '\n';
         return false;
     }
+    return true;
+}
 
-    iconv_close(cd);
+// Converts path components to the output encoding. Results are shared by all workers,
+// so that a directory name is detected and converted once however many files it holds.
+class name_converter_t
+{
+public:
+    fs::path convert(const fs::path &component)
+    {
+        const std::string name = component.string();
+        {
+            std::lock_guard lck(mtx_);
+            if (const auto it = names_.find(name); it != names_.end()) {
+                return it->second;
+            }
+        }
+        fs::path converted = convert_name(name);
+        std::lock_guard lck(mtx_);
+        return names_.emplace(name, std::move(converted)).first->second;
+    }
 
-    std::ofstream output_file(output_filename, std::ios::binary);
-    if (!output_file.is_open()) {
-        serr << "cannot open file: " << output_filename << '\n';
-        return false;
+    // `path` with every component below `root` converted
+    fs::path convert_below(const fs::path &root, const fs::path &path)
+    {
+        fs::path result = root;
+        for (const auto &component : path.lexically_relative(root)) {
+            result /= component == "." ? component : convert(component);
+        }
+        return result;
     }
 
-    output_file.write(output_buffer.data(), output_buffer_size - out_left);
-    return true;
+private:
+    static fs::path convert_name(const std::string &name)
+    {
+        std::vector<char> buffer(name.begin(), name.end());
+        const size_t ascii = native::ascii_prefix(buffer.data(), buffer.size());
+        if (ascii == buffer.size()) {
+            return name;
+        }
+        // names are too short for uchardet alone, so its guess must also decode the whole name
+        std::string from = "UTF-8";
+        if (ascii + native::utf8_prefix(buffer.data() + ascii, buffer.size() - ascii) != buffer.size()) {
+            thread_local static uchardet_guard_t cd;
+            uchardet_reset(cd);
+            uchardet_handle_data(cd, buffer.data(), buffer.size());
+            uchardet_data_end(cd);
+            from = uchardet_get_charset(cd);
+            if (from.empty() || !decodes_strictly(buffer, from)) {
+                std::osyncstream(std::cerr) << "cannot detect the encoding of name " << fs::path(name) << ", kept as is\n";
+                return name;
+            }
+        }
+        if (from == g.to.value() || (is_utf8_name(from) && is_utf8_name(g.to.value()))) {
+            return name;
+        }
+
+        std::vector<char> output;
+        auto conversion = g_backends->open(g.to.value(), from, native::unmappable_t::fail, buffer);
+        if (!conversion || !transcode(*conversion, buffer, output) ||
+            std::find_if(output.begin(), output.end(), [](char c) { return c == '\0' || c == '/'; }) != output.end()) {
+            std::osyncstream(std::cerr) << "cannot convert name " << fs::path(name) << "(" << from << ") to " << g.to.value() << ", kept as is\n";
+            return name;
+        }
+        return std::string(output.begin(), output.end());
+    }
+
+    std::mutex mtx_;
+    std::map<std::string, fs::path> names_;
+};
+
+static name_converter_t g_name_converter;
+
+// throws std::runtime_error for a charset the output cannot be written in
+static std::string target_encoding(const fs::path &input_path)
+{
+    if (g.editorconfig_target) {
+        const auto charset = g_editorconfig.charset(input_path);
+        if (charset == editorconfig_t::utf8_bom) {
+            throw std::runtime_error("charset = utf-8-bom of .editorconfig is not supported as the target of " + input_path.string() + ", outputs are written without a BOM");
+        }
+        return charset.value_or(g.to.value());
+    }
+    return g.to.value();
+}
+
+// The end of the last complete UTF-8 character in [begin, end), so that a piece cut there does not split one
+static const char *utf8_boundary(const char *begin, const char *end)
+{
+    const char *p = end;
+    while (p > begin && end - p < 4 && (static_cast<unsigned char>(p[-1]) & 0xC0) == 0x80) {
+        --p;
+    }
+    if (p == begin) {
+        return end;
+    }
+    const unsigned char lead = p[-1];
+    const std::ptrdiff_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return end - (p - 1) < length ? p - 1 : end;
 }
 
-static processing_status process_file(const fs::path &input_path, const fs::path &output_path)
+// Print the lines of `input_path` that match g.grep, as `line:text` or `path:line:text` for directory inputs.
+// The file is decoded to UTF-8 in fixed-size chunks and only the current line is kept, so memory does not grow
+// with the file; lines longer than max_line are matched in pieces of that size.
+static processing_status grep_file(const fs::path &input_path, const std::string &from_encoding, const std::string &to_encoding)
+{
+    constexpr size_t chunk_size = 256 * 1024;
+    constexpr size_t max_line = 1024 * 1024;
+    std::osyncstream sout(std::cout);
+    std::osyncstream serr(std::cerr);
+
+    std::ifstream file(input_path, std::ios::binary);
+    if (!file.is_open()) {
+        serr << "cannot open file: " << input_path << '\n';
+        return processing_status::error;
+    }
+    const bool decode = !is_utf8_name(from_encoding) && from_encoding != "ASCII";
+    const bool encode = !is_utf8_name(to_encoding);
+    std::unique_ptr<conversion_t> decoder;
+    std::unique_ptr<conversion_t> encoder;
+    const std::string prefix = g.grep_paths ? input_path.string() + ':' : std::string();
+
+    std::uint64_t line_number = 1;
+    const auto match = [&](const char *begin, const char *end) {
+        const char *const text_end = end > begin && end[-1] == '\r' ? end - 1 : end;
+        if (!std::regex_search(begin, text_end, *g.grep)) {
+            return true;
+        }
+        std::vector<char> line(begin, text_end);
+        if (encode) {
+            std::vector<char> encoded;
+            if (!encoder) {
+                encoder = g_backends->open(to_encoding, "UTF-8", g.unmappable, line);
+            }
+            if (!encoder || !transcode(*encoder, line, encoded)) {
+                serr << "cannot print line " << line_number << " of " << input_path << " in " << to_encoding << ": " << std::strerror(errno) << '\n';
+                return false;
+            }
+            line = std::move(encoded);
+        }
+        sout << prefix << line_number << ':';
+        sout.write(line.data(), line.size());
+        sout << '\n';
+        // whole lines stay together, but matches are not held until the end of the file
+        sout.emit();
+        return true;
+    };
+
+    std::vector<char> chunk(chunk_size);
+    std::vector<char> pending; // input not decoded yet: an incomplete character at the end of the last chunk
+    std::vector<char> text; // decoded text from the start of the current line
+    std::vector<char> decoded;
+    bool eof = false;
+    while (!eof) {
+        file.read(chunk.data(), chunk.size());
+        const size_t n = file.gcount();
+        eof = n < chunk.size();
+        if (!decode) {
+            text.insert(text.end(), chunk.begin(), chunk.begin() + n);
+        } else {
+            pending.insert(pending.end(), chunk.begin(), chunk.begin() + n);
+            if (!decoder) {
+                decoder = g_backends->open("UTF-8", from_encoding, native::unmappable_t::fail, pending);
+                if (!decoder) {
+                    serr << "cannot convert " << input_path << "(" << from_encoding << ") -> UTF-8: " << std::strerror(errno) << '\n';
+                    return processing_status::error;
+                }
+            }
+            decoded.resize(pending.size() * 4 + 16);
+            char *in_ptr = pending.data();
+            size_t in_left = pending.size();
+            char *out_ptr = decoded.data();
+            size_t out_left = decoded.size();
+            const bool failed = decoder->convert(&in_ptr, &in_left, &out_ptr, &out_left) == static_cast<size_t>(-1) && (errno != EINVAL || eof);
+            // the end of the input also reports a partial character the decoder kept
+            if (failed || (eof && decoder->convert(nullptr, nullptr, &out_ptr, &out_left) == static_cast<size_t>(-1))) {
+                serr << "decode " << input_path << "(" << from_encoding << ") failed near line " << line_number << ": " << std::strerror(errno) << '\n';
+                return processing_status::error;
+            }
+            text.insert(text.end(), decoded.data(), out_ptr);
+            pending.erase(pending.begin(), pending.begin() + (in_ptr - pending.data()));
+        }
+
+        const char *line = text.data();
+        const char *const end = text.data() + text.size();
+        for (const char *newline; (newline = static_cast<const char *>(std::memchr(line, '\n', end - line))) != nullptr; line = newline + 1) {
+            if (!match(line, newline)) {
+                return processing_status::error;
+            }
+            ++line_number;
+        }
+        if (end - line > static_cast<std::ptrdiff_t>(max_line) || (eof && line != end)) {
+            // the rest of a character cut by the chunk starts the next piece of the line
+            const char *const cut = eof ? end : utf8_boundary(line, end);
+            if (!match(line, cut)) {
+                return processing_status::error;
+            }
+            line = cut;
+        }
+        text.erase(text.begin(), text.begin() + (line - text.data()));
+    }
+    return processing_status::success;
+}
+
+// With a `member` the converted text is kept there for an archive instead of being written to `output_path`
+static processing_status process_file(const fs::path &input_path, const fs::path &output_path, std::vector<char> *member = nullptr)
 {
     std::osyncstream sout(std::cout);
     std::osyncstream serr(std::cerr);
@@ -515,18 +1530,30 @@ static processing_status process_file(const fs::path &input_path, const fs::path
             return processing_status::skip;
         }
 
+        const std::string to_encoding = target_encoding(input_path);
+
+        if (g.grep) {
+            if (g.dry_run) {
+                sout << "would search: " << input_path << "(" << file_encoding << ")\n";
+                return processing_status::success;
+            }
+            const processing_status status = grep_file(input_path, file_encoding, to_encoding);
+            if (status == processing_status::success) {
+                ++g_processed_files;
+            }
+            return status;
+        }
+
         if (g.dry_run) {
-            sout << "would convert: " << input_path << "(" << file_encoding << ") -> " << output_path << "(" << g.to.value() << ")\n";
+            sout << "would convert: " << input_path << "(" << file_encoding << ") -> " << output_path << "(" << to_encoding << ")\n";
             return processing_status::success;
         }
 
-        fs::create_directories(fs::path(output_path).parent_path());
-
         if (g.verbose) {
-            sout << "converting: " << input_path << "(" << file_encoding << ") -> " << output_path << "(" << g.to.value() << ")\n";
+            sout << "converting: " << input_path << "(" << file_encoding << ") -> " << output_path << "(" << to_encoding << ")\n";
         }
         // convert file encoding
-        if (!convert_encoding(input_path, file_encoding, output_path, g.to.value())) {
+        if (!convert_encoding(input_path, file_encoding, output_path, to_encoding, member)) {
             return processing_status::error;
         }
         ++g_processed_files;
@@ -537,6 +1564,133 @@ static processing_status process_file(const fs::path &input_path, const fs::path
     }
 }
 
+// Convert `tasks` into a single archive at `archive`. Members are sorted by name so that the archive only depends
+// on the input tree; they are converted in parallel a batch at a time, which bounds the memory held for reordering.
+static bool pack_directory(const std::vector<std::pair<fs::path, fs::path>> &tasks, const fs::path &archive)
+{
+    struct member_t
+    {
+        fs::path input;
+        fs::path output;
+        std::string name;
+        std::optional<std::vector<char>> data;
+    };
+    std::vector<member_t> members;
+    members.reserve(tasks.size());
+    for (const auto &[input, target] : tasks) {
+        fs::path output = g.convert_names ? g_name_converter.convert_below(archive, target) : target;
+        std::string name = output.lexically_relative(archive).lexically_normal().generic_string();
+        members.push_back({input, std::move(output), std::move(name), std::nullopt});
+    }
+    std::sort(members.begin(), members.end(), [](const member_t &a, const member_t &b) {
+        return a.name < b.name;
+    });
+
+    std::unique_ptr<tar_writer_t> writer;
+    if (!g.dry_run) {
+        fs::create_directories(archive.parent_path());
+        writer = std::make_unique<tar_writer_t>(archive, g.output_format == output_format_t::tar_gz);
+    }
+    constexpr size_t batch_size = 1024;
+    bool succeeded = true;
+    for (auto batch = members.begin(); batch != members.end();) {
+        const auto batch_end = batch + std::min<size_t>(batch_size, members.end() - batch);
+        succeeded = std::transform_reduce(
+                        std::execution::par,
+                        batch,
+                        batch_end,
+                        true,
+                        [](bool a, bool b) { return a && b; },
+                        [](member_t &member) {
+                            std::vector<char> data;
+                            const processing_status status = process_file(member.input, member.output, &data);
+                            if (status == processing_status::success) {
+                                member.data = std::move(data);
+                            }
+                            return status != processing_status::error;
+                        }) &&
+                    succeeded;
+        for (; batch != batch_end; ++batch) {
+            if (writer && batch->data) {
+                // members keep the time and permissions of their input like the files output does
+                struct stat st;
+                if (::stat(batch->input.c_str(), &st) != 0) {
+                    throw std::runtime_error("cannot stat file: " + batch->input.string());
+                }
+                writer->add(batch->name, *batch->data, st.st_mtime, st.st_mode & 07777);
+                batch->data.reset();
+            }
+        }
+    }
+    if (writer) {
+        writer->finish();
+    }
+    return succeeded;
+}
+
+static volatile std::sig_atomic_t g_stop_following = 0;
+
+// Convert the input files of `tasks` and then keep their outputs up to date as the inputs grow, until interrupted.
+// A file whose update fails is reported and no longer followed.
+static processing_status process_follow(const std::vector<std::pair<fs::path, fs::path>> &tasks)
+{
+    constexpr auto poll_interval = std::chrono::milliseconds(250);
+    std::osyncstream sout(std::cout);
+    bool has_failed = false;
+
+    std::vector<std::unique_ptr<follower_t>> followers;
+    for (const auto &[input, output] : tasks) {
+        try {
+            if (!should_include_suffix(input) || (fs::file_size(input) > 0 && !is_text_file(input))) {
+                continue;
+            }
+            std::string file_encoding = detect_encoding(input);
+            if (file_encoding == "empty file") {
+                file_encoding = "ASCII";
+            }
+            if (g.dry_run) {
+                sout << "would follow: " << input << "(" << file_encoding << ") -> " << output << "(" << target_encoding(input) << ")\n";
+                continue;
+            }
+            const auto detect = [input](const std::vector<char> &buffer) {
+                return detect_encoding(input, buffer, buffer.size());
+            };
+            const std::string to_encoding = target_encoding(input);
+            const auto rewrite = [to_encoding](std::vector<char> &buffer, const std::string &from_encoding) {
+                rewrite_declaration(buffer, from_encoding, to_encoding);
+            };
+            auto follower = std::make_unique<follower_t>(*g_backends, input, output, file_encoding, to_encoding, g.unmappable, detect, rewrite);
+            follower->update();
+            if (g.verbose) {
+                sout << "following: " << input << "(" << follower->from_encoding() << ") -> " << output << '\n';
+            }
+            sout.emit();
+            ++g_processed_files;
+            followers.push_back(std::move(follower));
+        } catch (const std::exception &ex) {
+            std::cerr << "convert failed for " << input << ": " << ex.what() << '\n';
+            has_failed = true;
+        }
+    }
+
+    std::signal(SIGINT, [](int) { g_stop_following = 1; });
+    std::signal(SIGTERM, [](int) { g_stop_following = 1; });
+    while (!g_stop_following && !followers.empty()) {
+        std::this_thread::sleep_for(poll_interval);
+        for (auto it = followers.begin(); it != followers.end();) {
+            try {
+                (*it)->update();
+                ++it;
+            } catch (const std::exception &ex) {
+                std::cerr << "stop following: " << ex.what() << '\n';
+                has_failed = true;
+                it = followers.erase(it);
+            }
+        }
+    }
+    return has_failed ? processing_status::error : processing_status::success;
+}
+
 static processing_status process_directory(const fs::path &input_dir, const fs::path &output_dir)
 {
     std::osyncstream serr(std::cerr);
@@ -560,7 +1714,7 @@ static processing_status process_directory(const fs::path &input_dir, const fs::
                     }
                 }
                 // we treat regular file as processing unit
-                if (entry.is_regular_file() && !should_exclude(entry.path())) {
+                if (entry.is_regular_file() && !should_exclude(entry.path()) && should_include_entry(entry)) {
                     const fs::path filename = entry.path().filename();
                     const fs::path relative_path = fs::relative(entry.path(), input_dirs[i]);
 
@@ -588,7 +1742,16 @@ static processing_status process_directory(const fs::path &input_dir, const fs::
         //         has_failed = true;
         //     }
         // }
-        if (tasks.size() >= std::thread::hardware_concurrency()) {
+        if (g.output_format != output_format_t::files) {
+            has_failed = !pack_directory(tasks, output_dir);
+        } else if (g.follow) {
+            if (g.convert_names) {
+                for (auto &[input, target] : tasks) {
+                    target = g_name_converter.convert_below(output_dir, target);
+                }
+            }
+            has_failed = process_follow(tasks) == processing_status::error;
+        } else if (tasks.size() >= std::thread::hardware_concurrency()) {
             // processor_pool_t pool;
             // for (const auto &[input, output] : tasks) {
             //     pool.post(process_file, input, output);
@@ -601,13 +1764,15 @@ static processing_status process_directory(const fs::path &input_dir, const fs::
                 tasks.cend(),
                 true,  // 初始值：没有错误
                 [](bool a, bool b) { return a && b; },  // 组合结果：只有当所有任务都成功时才成功
-                [](const auto &task) {
-                    return process_file(task.first, task.second) != processing_status::error;
+                [&output_dir](const auto &task) {
+                    const fs::path output = g.convert_names ? g_name_converter.convert_below(output_dir, task.second) : task.second;
+                    return process_file(task.first, output) != processing_status::error;
                 }
             );
             has_failed = !result;
         } else {
-            for (const auto &[input, output] : tasks) {
+            for (const auto &[input, target] : tasks) {
+                const fs::path output = g.convert_names ? g_name_converter.convert_below(output_dir, target) : target;
                 if (process_file(input, output) == processing_status::error) {
                     has_failed = true;
                 }
@@ -620,36 +1785,306 @@ static processing_status process_directory(const fs::path &input_dir, const fs::
     }
 }
 
+// Write the range g.slice of the converted text of `input_path` through a transcoding reader,
+// whose index is saved next to the input for the following slices
+static processing_status process_slice(const fs::path &input_path, const fs::path &output_path)
+{
+    std::osyncstream sout(std::cout);
+    std::osyncstream serr(std::cerr);
+    try {
+        const std::string file_encoding = detect_encoding(input_path);
+        if (file_encoding == "empty file") {
+            write_output(output_path, nullptr, 0);
+            return processing_status::success;
+        }
+        transcoding_reader_t reader(*g_backends, input_path, file_encoding, target_encoding(input_path), g.unmappable);
+        if (g.verbose) {
+            sout << (reader.index_loaded() ? "loaded index of " : "indexed ") << input_path << "(" << file_encoding << "): " << reader.size() << " bytes converted\n";
+        }
+        if (!reader.index_loaded()) {
+            try {
+                reader.save_index();
+            } catch (const std::exception &ex) {
+                serr << "index not saved: " << ex.what() << '\n';
+            }
+        }
+        const auto [offset, length] = *g.slice;
+        std::vector<char> text = reader.read(offset, static_cast<size_t>(std::min<std::uint64_t>(length, reader.size())));
+        if (g.dry_run) {
+            sout << "would write " << text.size() << " bytes of " << input_path << " -> " << output_path << '\n';
+            return processing_status::success;
+        }
+        write_output(output_path, text.data(), text.size());
+        ++g_processed_files;
+        return processing_status::success;
+    } catch (const std::exception &ex) {
+        serr << "convert failed for " << input_path << ": " << ex.what() << '\n';
+        return processing_status::error;
+    }
+}
+
+// Convert blob `oid`, checked out at `input_path`, into `converted`
+static processing_status process_blob(git_source_t &source,
+                                      const std::string &oid,
+                                      const fs::path &input_path,
+                                      const std::string &to_encoding,
+                                      std::vector<char> &converted,
+                                      std::string &digest,
+                                      std::optional<bool> &verified)
+{
+    std::osyncstream sout(std::cout);
+    std::osyncstream serr(std::cerr);
+    try {
+        std::vector<char> content = source.read(oid);
+        if (!is_text_buffer(content)) {
+            return processing_status::skip;
+        }
+        const std::string file_encoding = detect_encoding(input_path, content, content.size());
+        if (file_encoding == "empty file") {
+            if (g.dry_run || g.verbose) {
+                sout << "skip empty file: " << input_path << '\n';
+            }
+            return processing_status::skip;
+        }
+        if (g.dry_run) {
+            sout << "would convert: " << input_path << "(" << file_encoding << ", " << oid << ") -> " << to_encoding << '\n';
+            return processing_status::success;
+        }
+        if (g.verbose) {
+            sout << "converting: " << input_path << "(" << file_encoding << ", " << oid << ") -> " << to_encoding << '\n';
+        }
+        const std::unique_ptr<output_check_t> check = make_output_check(file_encoding, to_encoding);
+        if (!convert_buffer(content, input_path, file_encoding, input_path, to_encoding, &converted, check.get())) {
+            return processing_status::error;
+        }
+        if (check) {
+            digest = check->digest();
+            verified = check->verified();
+        }
+        return processing_status::success;
+    } catch (const std::exception &ex) {
+        serr << "convert failed for " << input_path << ": " << ex.what() << '\n';
+        return processing_status::error;
+    }
+}
+
+// Convert the files of revision g.rev of the repository g.git into `output_dir`, or into an archive there.
+// Paths sharing a blob (and target encoding) convert it once, the result being kept until its last path is written.
+static processing_status process_git(const fs::path &output_dir)
+{
+    std::osyncstream serr(std::cerr);
+    try {
+        git_source_t source(*g.git, g.rev, g.recursive);
+
+        struct member_t
+        {
+            fs::path input;
+            fs::path output;
+            std::string name;
+            std::string oid;
+            std::string to_encoding;
+            std::optional<std::vector<char>> data;
+            unsigned mode;
+        };
+        std::vector<member_t> members;
+        std::map<std::string, size_t> uses;
+        bool succeeded = true;
+        for (const auto &entry : source.entries()) {
+            const fs::path relative(entry.path);
+            bool excluded = false;
+            fs::path dir = g.input;
+            for (auto it = relative.begin(); !excluded && std::next(it) != relative.end(); ++it) {
+                dir /= *it;
+                excluded = should_exclude(dir);
+            }
+            const fs::path input = g.input / relative;
+            if (excluded || should_exclude(input) || !should_include_suffix(input) || !should_include_size(entry.size)) {
+                continue;
+            }
+            fs::path output = output_dir / relative;
+            if (g.convert_names) {
+                output = g_name_converter.convert_below(output_dir, output);
+            }
+            std::string name = output.lexically_relative(output_dir).generic_string();
+            std::string to_encoding;
+            try {
+                to_encoding = target_encoding(input);
+            } catch (const std::exception &ex) {
+                serr << ex.what() << '\n';
+                succeeded = false;
+                continue;
+            }
+            ++uses[entry.oid + '\0' + to_encoding];
+            members.push_back({input, std::move(output), std::move(name), entry.oid, std::move(to_encoding), std::nullopt, entry.mode});
+        }
+        std::sort(members.begin(), members.end(), [](const member_t &a, const member_t &b) {
+            return a.name < b.name;
+        });
+
+        std::unique_ptr<tar_writer_t> writer;
+        if (g.output_format != output_format_t::files && !g.dry_run) {
+            fs::create_directories(output_dir.parent_path());
+            writer = std::make_unique<tar_writer_t>(output_dir, g.output_format == output_format_t::tar_gz);
+        }
+
+        struct converted_blob_t
+        {
+            processing_status status;
+            std::vector<char> data;
+            std::string digest;
+            std::optional<bool> verified;
+        };
+        std::mutex mtx;
+        std::map<std::string, std::pair<std::shared_future<converted_blob_t>, size_t>> shared;
+        const auto convert = [&](member_t &member) {
+            const std::string key = member.oid + '\0' + member.to_encoding;
+            std::optional<converted_blob_t> own;
+            std::shared_future<converted_blob_t> result;
+            std::promise<converted_blob_t> promise;
+            bool owner = true;
+            if (uses.at(key) > 1) {
+                std::lock_guard lck(mtx);
+                auto [it, inserted] = shared.try_emplace(key);
+                if (inserted) {
+                    it->second = {promise.get_future().share(), uses.at(key)};
+                }
+                owner = inserted;
+                result = it->second.first;
+            }
+            if (owner) {
+                converted_blob_t blob;
+                blob.status = process_blob(source, member.oid, member.input, member.to_encoding, blob.data, blob.digest, blob.verified);
+                if (result.valid()) {
+                    promise.set_value(std::move(blob));
+                } else {
+                    own = std::move(blob);
+                }
+            }
+            const converted_blob_t &blob = own ? *own : result.get();
+            if (blob.status == processing_status::success && !g.dry_run) {
+                if (writer) {
+                    member.data = own ? std::move(own->data) : blob.data;
+                } else {
+                    try {
+                        write_output(member.output, blob.data.data(), blob.data.size());
+                    } catch (const std::exception &ex) {
+                        std::osyncstream(std::cerr) << ex.what() << '\n';
+                        return false;
+                    }
+                }
+                if (g.checksum != checksum_t::none || g.verify) {
+                    g_checksums.record(member.output, blob.digest, blob.verified);
+                }
+                ++g_processed_files;
+            }
+            const bool succeeded = blob.status != processing_status::error;
+            if (result.valid()) {
+                std::lock_guard lck(mtx);
+                if (const auto it = shared.find(key); --it->second.second == 0) {
+                    shared.erase(it);
+                }
+            }
+            return succeeded;
+        };
+
+        constexpr size_t batch_size = 1024;
+        for (auto batch = members.begin(); batch != members.end();) {
+            const auto batch_end = batch + std::min<size_t>(batch_size, members.end() - batch);
+            succeeded = std::transform_reduce(std::execution::par, batch, batch_end, true, [](bool a, bool b) { return a && b; }, convert) && succeeded;
+            for (; batch != batch_end; ++batch) {
+                if (writer && batch->data) {
+                    writer->add(batch->name, *batch->data, source.time(), batch->mode);
+                    batch->data.reset();
+                }
+            }
+        }
+        if (writer) {
+            writer->finish();
+        }
+        return succeeded ? processing_status::success : processing_status::error;
+    } catch (const std::exception &ex) {
+        serr << "git input failed: " << ex.what() << '\n';
+        return processing_status::error;
+    }
+}
+
 int main(int argc, char *argv[])
 {
     bool has_failed = false;
     try {
         g.init(argc, argv);
-        std::cout << "convert start...\n";
+        g_backends = std::make_unique<backend_selector_t>(g.backend, g.verbose);
+        // the matched lines are the whole output of a search
+        if (!g.grep) {
+            std::cout << "convert start...\n";
+        }
 
         g.input = fs::absolute(g.input);
-        g.output = fs::absolute(g.output);
+        if (g.git) {
+            g.git = g.input;
+        }
+        if (!g.output.empty()) {
+            g.output = fs::absolute(g.output);
+        }
 
         if (!fs::exists(g.input)) {
             std::cerr << "input file or directory does not exist: " << g.input << '\n';
             return 1;
         }
+        g.grep_paths = g.grep && !g.git && fs::is_directory(g.input);
 
         // Check if input is directory
-        if (fs::is_directory(g.input)) {
+        if (g.slice && (g.git || fs::is_directory(g.input))) {
+            std::cerr << "--slice needs a single file input\n";
+            return 1;
+        }
+        if (g.git) {
+            if (process_git(g.output) == processing_status::error) {
+                has_failed = true;
+            }
+        } else if (fs::is_directory(g.input)) {
             if (process_directory(g.input, g.output) == processing_status::error) {
                 has_failed = true;
             }
+        } else if (g.output_format != output_format_t::files) {
+            std::cerr << "--output-format tar and tar.gz need a directory input\n";
+            return 1;
+        } else if (g.follow) {
+            if (process_follow({{g.input, g.output}}) == processing_status::error) {
+                has_failed = true;
+            }
+        } else if (g.slice) {
+            if (process_slice(g.input, g.output) == processing_status::error) {
+                has_failed = true;
+            }
         } else {
             if (process_file(g.input, g.output) == processing_status::error) {
                 has_failed = true;
             }
         }
+        direct_io_release();
 
+        if (g.checksum != checksum_t::none && !g.dry_run) {
+            fs::path checksum_file = g.checksum_file;
+            if (checksum_file.empty()) {
+                checksum_file = g.output;
+                checksum_file += std::string(".") + checksum_name(g.checksum);
+            }
+            g_checksums.write(fs::absolute(checksum_file));
+        }
+        if (g_checksums.failed()) {
+            has_failed = true;
+        }
         if (has_failed) {
             std::cerr << "convert failed\n";
             return 1;
         }
+        if (g.grep) {
+            if (g.verbose) {
+                std::cerr << "searched " << g_processed_files << " files.\n";
+            }
+            return 0;
+        }
         std::cout << "convert done. processed " << g_processed_files << " files.\n";
         return 0;
     } catch (const std::exception &ex) {
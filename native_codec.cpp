@@ -0,0 +1,329 @@
+#include "native_codec.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <string_view>
+
+#include "simd.h"
+#include "tables/dispatch.h"
+
+namespace native
+{
+namespace
+{
+bool iequals(std::string_view a, std::string_view b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+        return std::toupper(static_cast<unsigned char>(x)) == std::toupper(static_cast<unsigned char>(y));
+    });
+}
+
+bool is_utf8(const std::string &name)
+{
+    return iequals(name, "UTF-8") || iequals(name, "UTF8");
+}
+
+// Decode one character, returning 0 or an errno value; `next` is only advanced on success
+inline int decode_table(const charset_t *cs, const std::uint8_t *&next, const std::uint8_t *end, char32_t &cp)
+{
+    const std::uint8_t *p = next;
+    std::uint16_t e = cs->decode[0][*p++];
+    while (e >= decode_link && e < 0xE000) {
+        if (p == end) {
+            return EINVAL;
+        }
+        e = cs->decode[e - decode_link][*p++];
+    }
+    if (e == decode_invalid) {
+        return EILSEQ;
+    }
+    cp = e;
+    next = p;
+    return 0;
+}
+
+inline int decode_utf8(const std::uint8_t *&next, const std::uint8_t *end, char32_t &cp)
+{
+    const std::uint8_t *p = next;
+    const std::uint8_t b = *p;
+    size_t n;
+    char32_t c;
+    if (b < 0x80) {
+        cp = b;
+        next = p + 1;
+        return 0;
+    }
+    // straight-line paths for complete two and three byte sequences, which is all of CJK and most other scripts
+    if (b >= 0xE0 && b <= 0xEF && end - p >= 3 && (p[1] & 0xC0) == 0x80 && (p[2] & 0xC0) == 0x80) {
+        c = ((b & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+        if (c < 0x800 || (c >= 0xD800 && c < 0xE000)) {
+            return EILSEQ;
+        }
+        cp = c;
+        next = p + 3;
+        return 0;
+    }
+    if (b >= 0xC2 && b <= 0xDF && end - p >= 2 && (p[1] & 0xC0) == 0x80) {
+        cp = ((b & 0x1F) << 6) | (p[1] & 0x3F);
+        next = p + 2;
+        return 0;
+    }
+    if (b >= 0xC2 && b <= 0xDF) {
+        n = 1;
+        c = b & 0x1F;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        n = 2;
+        c = b & 0x0F;
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        n = 3;
+        c = b & 0x07;
+    } else {
+        return EILSEQ;
+    }
+    for (size_t i = 1; i <= n; ++i) {
+        if (p + i == end) {
+            return EINVAL;
+        }
+        if ((p[i] & 0xC0) != 0x80) {
+            return EILSEQ;
+        }
+        c = (c << 6) | (p[i] & 0x3F);
+        // reject overlong forms, surrogates and code points above U+10FFFF as soon as they are known
+        if (i == 1 && ((n == 2 && (c < 0x20 || (c >= 0x360 && c < 0x380))) || (n == 3 && (c < 0x10 || c > 0x10F)))) {
+            return EILSEQ;
+        }
+    }
+    cp = c;
+    next = p + n + 1;
+    return 0;
+}
+
+// Encode table entry for `cp`, 0 if unmappable
+inline std::uint32_t encode_table(const charset_t *cs, char32_t cp)
+{
+    const std::uint16_t page = cs->encode_index[cp >> 8];
+    return page == 0 ? 0 : cs->encode[page - 1][cp & 0xFF];
+}
+
+// Store the bytes of an encode table entry, false if they do not fit
+inline bool store_entry(std::uint32_t e, std::uint8_t *&out, std::uint8_t *out_end)
+{
+    const size_t n = e & 0xFF;
+    if (static_cast<size_t>(out_end - out) >= 3) {
+        out[0] = static_cast<std::uint8_t>(e >> 8);
+        out[1] = static_cast<std::uint8_t>(e >> 16);
+        out[2] = static_cast<std::uint8_t>(e >> 24);
+    } else if (static_cast<size_t>(out_end - out) >= n) {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = static_cast<std::uint8_t>(e >> (8 * (i + 1)));
+        }
+    } else {
+        return false;
+    }
+    out += n;
+    return true;
+}
+
+size_t encode_utf8(char32_t cp, std::uint8_t buf[4])
+{
+    if (cp < 0x80) {
+        buf[0] = static_cast<std::uint8_t>(cp);
+        return 1;
+    } else if (cp < 0x800) {
+        buf[0] = static_cast<std::uint8_t>(0xC0 | (cp >> 6));
+        buf[1] = static_cast<std::uint8_t>(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        buf[0] = static_cast<std::uint8_t>(0xE0 | (cp >> 12));
+        buf[1] = static_cast<std::uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = static_cast<std::uint8_t>(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    buf[0] = static_cast<std::uint8_t>(0xF0 | (cp >> 18));
+    buf[1] = static_cast<std::uint8_t>(0x80 | ((cp >> 12) & 0x3F));
+    buf[2] = static_cast<std::uint8_t>(0x80 | ((cp >> 6) & 0x3F));
+    buf[3] = static_cast<std::uint8_t>(0x80 | (cp & 0x3F));
+    return 4;
+}
+}
+
+size_t ascii_prefix(const char *data, size_t size)
+{
+    static constexpr std::uint8_t no_exceptions[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+    return simd::ascii_span(reinterpret_cast<const std::uint8_t *>(data), size, no_exceptions);
+}
+
+size_t utf8_prefix(const char *data, size_t size)
+{
+    const std::uint8_t *p = reinterpret_cast<const std::uint8_t *>(data);
+    const std::uint8_t *const end = p + size;
+    while (p < end) {
+        p += ascii_prefix(reinterpret_cast<const char *>(p), end - p);
+        char32_t cp;
+        if (p == end || decode_utf8(p, end, cp) != 0) {
+            break;
+        }
+    }
+    return p - reinterpret_cast<const std::uint8_t *>(data);
+}
+
+const charset_t *find_charset(const std::string &name)
+{
+    std::string upper(name);
+    std::transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) {
+        return static_cast<char>(std::toupper(c));
+    });
+    const auto it = std::lower_bound(std::begin(tables::dispatch), std::end(tables::dispatch), upper, [](const tables::dispatch_entry_t &entry, const std::string &key) {
+        return entry.name < key;
+    });
+    // charsets the linked iconv could not tabulate are listed without tables
+    if (it == std::end(tables::dispatch) || it->name != upper || it->charset->decode == nullptr) {
+        return nullptr;
+    }
+    return it->charset;
+}
+
+std::unique_ptr<converter_t> converter_t::open(const std::string &to_encoding, const std::string &from_encoding, unmappable_t unmappable)
+{
+    const charset_t *from = is_utf8(from_encoding) ? nullptr : find_charset(from_encoding);
+    const charset_t *to = is_utf8(to_encoding) ? nullptr : find_charset(to_encoding);
+    if ((from == nullptr && !is_utf8(from_encoding)) || (to == nullptr && !is_utf8(to_encoding)) || (from == nullptr && to == nullptr)) {
+        return nullptr;
+    }
+    return std::unique_ptr<converter_t>(new converter_t(from, to, unmappable));
+}
+
+converter_t::converter_t(const charset_t *from, const charset_t *to, unmappable_t unmappable)
+    : from_(from)
+    , to_(to)
+    , ascii_exceptions_{0xFF, 0xFF, 0xFF, 0xFF}
+    , ascii_fast_(true)
+    , unmappable_(unmappable)
+    , substitute_(to ? encode_table(to, U'?') : 0)
+{
+    // an ASCII byte may only be copied through if neither side remaps it
+    size_t count = 0;
+    for (const charset_t *cs : {from, to}) {
+        if (cs == nullptr) {
+            continue;
+        }
+        ascii_fast_ = ascii_fast_ && cs->ascii_fast;
+        for (std::uint8_t b : cs->ascii_exceptions) {
+            if (b < 0x80 && std::find(ascii_exceptions_, ascii_exceptions_ + count, b) == ascii_exceptions_ + count) {
+                if (count == 4) {
+                    ascii_fast_ = false;
+                    break;
+                }
+                ascii_exceptions_[count++] = b;
+            }
+        }
+    }
+}
+
+size_t converter_t::convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft)
+{
+    const std::uint8_t *in = reinterpret_cast<const std::uint8_t *>(*inbuf);
+    const std::uint8_t *const in_end = in + *inbytesleft;
+    std::uint8_t *out = reinterpret_cast<std::uint8_t *>(*outbuf);
+    std::uint8_t *const out_end = out + *outbytesleft;
+
+    // instantiate the loop per direction so that the per-character dispatch folds away
+    int error;
+    if (to_ == nullptr && from_->utf8 != nullptr) {
+        error = run_single_byte(in, in_end, out, out_end);
+    } else if (from_ == nullptr) {
+        error = run<false, true>(in, in_end, out, out_end);
+    } else if (to_ == nullptr) {
+        error = run<true, false>(in, in_end, out, out_end);
+    } else {
+        error = run<true, true>(in, in_end, out, out_end);
+    }
+
+    *inbytesleft = in_end - in;
+    *inbuf = reinterpret_cast<char *>(const_cast<std::uint8_t *>(in));
+    *outbytesleft = out_end - out;
+    *outbuf = reinterpret_cast<char *>(out);
+    if (error != 0) {
+        errno = error;
+        return static_cast<size_t>(-1);
+    }
+    return 0;
+}
+
+template<bool FromTable, bool ToTable>
+int converter_t::run(const std::uint8_t *&in, const std::uint8_t *in_end, std::uint8_t *&out, std::uint8_t *out_end) const
+{
+    while (in < in_end) {
+        if (ascii_fast_ && *in < 0x80) {
+            const size_t n = simd::ascii_span(in, std::min(in_end - in, out_end - out), ascii_exceptions_);
+            std::memcpy(out, in, n);
+            in += n;
+            out += n;
+            if (in == in_end) {
+                break;
+            }
+        }
+
+        const std::uint8_t *next = in;
+        char32_t cp = 0;
+        const int error = FromTable ? decode_table(from_, next, in_end, cp) : decode_utf8(next, in_end, cp);
+        if (error != 0) {
+            return error;
+        }
+        if constexpr (ToTable) {
+            std::uint32_t e = encode_table(to_, cp);
+            if (e == 0) {
+                if (unmappable_ == unmappable_t::fail) {
+                    return EILSEQ;
+                }
+                e = unmappable_ == unmappable_t::skip ? encode_ignored : substitute_;
+            }
+            if (!store_entry(e, out, out_end)) {
+                return E2BIG;
+            }
+        } else {
+            std::uint8_t buf[4];
+            const size_t n = encode_utf8(cp, buf);
+            if (static_cast<size_t>(out_end - out) < n) {
+                return E2BIG;
+            }
+            std::memcpy(out, buf, n);
+            out += n;
+        }
+        in = next;
+    }
+    return 0;
+}
+
+// Single-byte charset to UTF-8: SIMD over the ASCII half, one table load per byte of the high half
+int converter_t::run_single_byte(const std::uint8_t *&in, const std::uint8_t *in_end, std::uint8_t *&out, std::uint8_t *out_end) const
+{
+    const std::uint32_t *table = from_->utf8;
+    while (in < in_end) {
+        if (ascii_fast_ && *in < 0x80) {
+            const size_t n = simd::ascii_span(in, std::min(in_end - in, out_end - out), ascii_exceptions_);
+            std::memcpy(out, in, n);
+            in += n;
+            out += n;
+            if (in == in_end) {
+                break;
+            }
+        }
+
+        // stay in the table loop until the next ASCII run, storing all three bytes unconditionally while there is room
+        do {
+            const std::uint32_t e = table[*in];
+            if (e == 0) {
+                return EILSEQ;
+            }
+            if (!store_entry(e, out, out_end)) {
+                return E2BIG;
+            }
+            ++in;
+        } while (in < in_end && !(ascii_fast_ && *in < 0x80));
+    }
+    return 0;
+}
+}
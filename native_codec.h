@@ -0,0 +1,77 @@
+#ifndef NATIVE_CODEC_H
+#define NATIVE_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace native
+{
+// Decode tables are pages of 256 entries indexed by one input byte, page 0 being the lead byte.
+// An entry is either a BMP code point, a link to the next page (surrogate range), or invalid.
+inline constexpr std::uint16_t decode_invalid = 0xFFFF;
+inline constexpr std::uint16_t decode_link = 0xD800;
+
+// Encode tables are two-level pages keyed by code point: encode_index[cp >> 8] holds page + 1 (0 = unmapped),
+// and an entry holds the output bytes in order from bit 8 upwards and the byte count in the low 8 bits, like the
+// UTF-8 table below. 0 is unmapped, encode_ignored is a character that iconv accepts but produces nothing for.
+inline constexpr std::uint32_t encode_ignored = 0x100;
+
+// What to do with characters the target charset cannot represent
+enum class unmappable_t {
+    fail,
+    skip,
+    substitute,
+};
+
+struct charset_t
+{
+    const char *name;
+    const std::uint16_t (*decode)[256];
+    const std::uint16_t *encode_index;
+    const std::uint32_t (*encode)[256];
+    // single-byte charsets only: UTF-8 bytes of each byte from bit 8 upwards, byte count in the low 8 bits (0 = invalid)
+    const std::uint32_t *utf8;
+    // ASCII bytes which do not round-trip to themselves (e.g. 0x5C is YEN SIGN in SHIFT_JIS), padded with 0xFF
+    std::uint8_t ascii_exceptions[4];
+    // false if there are too many exceptions for the vectorised ASCII skip
+    bool ascii_fast;
+};
+
+// Length of the leading pure-ASCII run of `data`
+size_t ascii_prefix(const char *data, size_t size);
+// Length of the longest prefix of `data` made of complete, well-formed UTF-8 characters
+size_t utf8_prefix(const char *data, size_t size);
+
+// Look up a table-driven charset by (case-insensitive) name or alias, nullptr if it has no native tables
+const charset_t *find_charset(const std::string &name);
+
+// Converter with the same calling convention as iconv(3): returns (size_t)-1 and sets errno to
+// E2BIG, EILSEQ or EINVAL, leaving the buffer pointers after the last fully converted character.
+class converter_t
+{
+public:
+    // nullptr if the pair is not handled natively, so that the caller falls back to iconv.
+    // Unless `unmappable` is fail, characters missing from the target are dropped or replaced by '?'.
+    static std::unique_ptr<converter_t> open(const std::string &to_encoding, const std::string &from_encoding, unmappable_t unmappable = unmappable_t::fail);
+
+    size_t convert(char **inbuf, size_t *inbytesleft, char **outbuf, size_t *outbytesleft);
+
+private:
+    converter_t(const charset_t *from, const charset_t *to, unmappable_t unmappable);
+
+    template<bool FromTable, bool ToTable>
+    int run(const std::uint8_t *&in, const std::uint8_t *in_end, std::uint8_t *&out, std::uint8_t *out_end) const;
+    int run_single_byte(const std::uint8_t *&in, const std::uint8_t *in_end, std::uint8_t *&out, std::uint8_t *out_end) const;
+
+    const charset_t *from_; // nullptr means UTF-8
+    const charset_t *to_; // nullptr means UTF-8
+    std::uint8_t ascii_exceptions_[4];
+    bool ascii_fast_;
+    unmappable_t unmappable_;
+    std::uint32_t substitute_; // encoded '?' in the same layout as an encode table entry
+};
+}
+
+#endif // NATIVE_CODEC_H
@@ -0,0 +1,96 @@
+#include "normalize.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "native_codec.h"
+
+#if WITH_ICU_BACKEND
+#include <unicode/bytestream.h>
+#include <unicode/normalizer2.h>
+#include <unicode/stringpiece.h>
+#include <unicode/utf8.h>
+
+namespace
+{
+// ICU takes lengths as int32_t, so longer text is normalised in pieces of at most this size
+constexpr size_t max_piece = size_t(1) << 30;
+
+// The end of the piece starting at `begin`: the end of the text, or the last character within max_piece that the
+// normaliser never combines with what precedes it, so that the pieces normalise the same as the whole text
+size_t piece_end(const icu::Normalizer2 &normalizer, const std::vector<char> &text, size_t begin)
+{
+    if (text.size() - begin <= max_piece) {
+        return text.size();
+    }
+    const auto *const data = reinterpret_cast<const uint8_t *>(text.data());
+    for (size_t pos = begin + max_piece; pos > begin; --pos) {
+        if (U8_IS_TRAIL(data[pos])) {
+            continue;
+        }
+        int32_t i = 0;
+        UChar32 c;
+        U8_NEXT(data + pos, i, static_cast<int32_t>(std::min<size_t>(U8_MAX_LENGTH, text.size() - pos)), c);
+        if (c >= 0 && normalizer.hasBoundaryBefore(c)) {
+            return pos;
+        }
+    }
+    throw std::runtime_error("normalization failed: no normalization boundary within " + std::to_string(max_piece) + " bytes");
+}
+}
+#endif
+
+bool normalization_available()
+{
+#if WITH_ICU_BACKEND
+    return true;
+#else
+    return false;
+#endif
+}
+
+void normalize_utf8(std::vector<char> &text, normalization_t form)
+{
+    if (form == normalization_t::none) {
+        return;
+    }
+    const size_t ascii = native::ascii_prefix(text.data(), text.size());
+    if (ascii == text.size()) {
+        return;
+    }
+#if WITH_ICU_BACKEND
+    UErrorCode status = U_ZERO_ERROR;
+    const icu::Normalizer2 *normalizer = form == normalization_t::nfc ? icu::Normalizer2::getNFCInstance(status) : icu::Normalizer2::getNFDInstance(status);
+    if (U_FAILURE(status)) {
+        throw std::runtime_error(std::string("failed to load normalization data: ") + u_errorName(status));
+    }
+
+    // the last ASCII character may still compose with the marks that follow it
+    const size_t start = ascii == 0 ? 0 : ascii - 1;
+    std::vector<icu::StringPiece> pieces;
+    for (size_t begin = start; begin < text.size();) {
+        const size_t end = piece_end(*normalizer, text, begin);
+        pieces.emplace_back(text.data() + begin, static_cast<int32_t>(end - begin));
+        begin = end;
+    }
+    if (std::all_of(pieces.begin(), pieces.end(), [&](const icu::StringPiece &piece) { return normalizer->isNormalizedUTF8(piece, status); }) &&
+        U_SUCCESS(status)) {
+        return;
+    }
+    status = U_ZERO_ERROR;
+    std::string normalized;
+    normalized.reserve(text.size() - start);
+    icu::StringByteSink<std::string> sink(&normalized);
+    for (const auto &piece : pieces) {
+        normalizer->normalizeUTF8(0, piece, sink, nullptr, status);
+        if (U_FAILURE(status)) {
+            throw std::runtime_error(std::string("normalization failed: ") + u_errorName(status));
+        }
+    }
+    text.resize(start);
+    text.insert(text.end(), normalized.begin(), normalized.end());
+#else
+    throw std::runtime_error("normalization requires a build with ICU");
+#endif
+}
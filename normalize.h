@@ -0,0 +1,20 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <string>
+#include <vector>
+
+enum class normalization_t {
+    none,
+    nfc,
+    nfd,
+};
+
+// false if this build has no Unicode normalisation (it comes with the ICU backend)
+bool normalization_available();
+
+// Normalise UTF-8 text in place. ASCII text and text that already passes the quick check are left untouched
+// without any copy. throws std::runtime_error if the text is not valid UTF-8 or normalisation is unavailable
+void normalize_utf8(std::vector<char> &text, normalization_t form);
+
+#endif // NORMALIZE_H
@@ -0,0 +1,200 @@
+#include "output_check.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#if WITH_OPENSSL
+#include <openssl/evp.h>
+#endif
+#if WITH_XXHASH
+#include <xxhash.h>
+#endif
+
+bool checksum_available(checksum_t algorithm)
+{
+    switch (algorithm) {
+    case checksum_t::none:
+        return true;
+    case checksum_t::sha256:
+#if WITH_OPENSSL
+        return true;
+#else
+        return false;
+#endif
+    case checksum_t::xxh3:
+#if WITH_XXHASH
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char *checksum_name(checksum_t algorithm)
+{
+    switch (algorithm) {
+    case checksum_t::sha256:
+        return "sha256";
+    case checksum_t::xxh3:
+        return "xxh3";
+    default:
+        return "none";
+    }
+}
+
+struct output_check_t::hash_t
+{
+#if WITH_OPENSSL
+    EVP_MD_CTX *sha256 = nullptr;
+#endif
+#if WITH_XXHASH
+    XXH3_state_t *xxh3 = nullptr;
+#endif
+
+    ~hash_t()
+    {
+#if WITH_OPENSSL
+        EVP_MD_CTX_free(sha256);
+#endif
+#if WITH_XXHASH
+        XXH3_freeState(xxh3);
+#endif
+    }
+};
+
+output_check_t::output_check_t(checksum_t algorithm, std::unique_ptr<conversion_t> reverse)
+    : algorithm_(algorithm)
+    , hash_(std::make_unique<hash_t>())
+    , reverse_(std::move(reverse))
+{
+    bool ready = algorithm == checksum_t::none;
+#if WITH_OPENSSL
+    if (algorithm == checksum_t::sha256) {
+        hash_->sha256 = EVP_MD_CTX_new();
+        ready = hash_->sha256 != nullptr && EVP_DigestInit_ex(hash_->sha256, EVP_sha256(), nullptr) == 1;
+    }
+#endif
+#if WITH_XXHASH
+    if (algorithm == checksum_t::xxh3) {
+        hash_->xxh3 = XXH3_createState();
+        ready = hash_->xxh3 != nullptr && XXH3_64bits_reset(hash_->xxh3) == XXH_OK;
+    }
+#endif
+    if (!ready) {
+        throw std::runtime_error(std::string("cannot compute ") + checksum_name(algorithm) + " checksums");
+    }
+}
+
+output_check_t::~output_check_t() = default;
+
+void output_check_t::input(const char *data, size_t size)
+{
+    if (reverse_ && !mismatch_) {
+        expected_.insert(expected_.end(), data, data + size);
+        compare();
+    }
+}
+
+void output_check_t::output(const char *data, size_t size)
+{
+#if WITH_OPENSSL
+    if (hash_->sha256 != nullptr) {
+        EVP_DigestUpdate(hash_->sha256, data, size);
+    }
+#endif
+#if WITH_XXHASH
+    if (hash_->xxh3 != nullptr) {
+        XXH3_64bits_update(hash_->xxh3, data, size);
+    }
+#endif
+    if (reverse_ && !mismatch_) {
+        // decode as far as possible and keep an incomplete trailing character for the next piece
+        undecoded_.insert(undecoded_.end(), data, data + size);
+        const size_t before = decoded_.size();
+        decoded_.resize(before + undecoded_.size() * 2 + 16);
+        char *in_ptr = undecoded_.data();
+        size_t in_left = undecoded_.size();
+        size_t produced = before;
+        while (in_left > 0) {
+            char *out_ptr = decoded_.data() + produced;
+            size_t out_left = decoded_.size() - produced;
+            const size_t result = reverse_->convert(&in_ptr, &in_left, &out_ptr, &out_left);
+            produced = decoded_.size() - out_left;
+            if (result != static_cast<size_t>(-1) || errno == EINVAL) {
+                break;
+            }
+            if (errno != E2BIG) {
+                mismatch_ = true;
+                break;
+            }
+            decoded_.resize(decoded_.size() << 1);
+        }
+        decoded_.resize(produced);
+        undecoded_.erase(undecoded_.begin(), undecoded_.begin() + (in_ptr - undecoded_.data()));
+        compare();
+    }
+}
+
+// drop the common prefix of what the output decoded to and the input
+void output_check_t::compare()
+{
+    const size_t n = std::min(decoded_.size(), expected_.size());
+    if (std::memcmp(decoded_.data(), expected_.data(), n) != 0) {
+        mismatch_ = true;
+    }
+    decoded_.erase(decoded_.begin(), decoded_.begin() + n);
+    expected_.erase(expected_.begin(), expected_.begin() + n);
+}
+
+std::string output_check_t::digest()
+{
+    if (!finished_) {
+        finished_ = true;
+        std::vector<unsigned char> bytes;
+#if WITH_OPENSSL
+        if (hash_->sha256 != nullptr) {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int size = 0;
+            EVP_DigestFinal_ex(hash_->sha256, md, &size);
+            bytes.assign(md, md + size);
+        }
+#endif
+#if WITH_XXHASH
+        if (hash_->xxh3 != nullptr) {
+            XXH64_canonical_t canonical;
+            XXH64_canonicalFromHash(&canonical, XXH3_64bits_digest(hash_->xxh3));
+            bytes.assign(canonical.digest, canonical.digest + sizeof(canonical.digest));
+        }
+#endif
+        static constexpr char hex[] = "0123456789abcdef";
+        for (unsigned char b : bytes) {
+            digest_ += hex[b >> 4];
+            digest_ += hex[b & 0xF];
+        }
+    }
+    return digest_;
+}
+
+std::optional<bool> output_check_t::verified()
+{
+    if (!reverse_) {
+        return std::nullopt;
+    }
+    if (!finished_reverse_ && !mismatch_) {
+        // the end of the output returns a stateful input encoding to its initial state
+        finished_reverse_ = true;
+        char buffer[64];
+        char *out_ptr = buffer;
+        size_t out_left = sizeof(buffer);
+        if (reverse_->convert(nullptr, nullptr, &out_ptr, &out_left) == static_cast<size_t>(-1)) {
+            mismatch_ = true;
+        } else {
+            decoded_.insert(decoded_.end(), buffer, out_ptr);
+            compare();
+        }
+    }
+    return !mismatch_ && undecoded_.empty() && decoded_.empty() && expected_.empty();
+}
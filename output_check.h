@@ -0,0 +1,62 @@
+#ifndef OUTPUT_CHECK_H
+#define OUTPUT_CHECK_H
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+enum class checksum_t {
+    none,
+    sha256,
+    xxh3,
+};
+
+// false if this build has no implementation of `algorithm`
+bool checksum_available(checksum_t algorithm);
+const char *checksum_name(checksum_t algorithm);
+
+// Digest and round-trip verification of one output, computed from the bytes while they are produced, so that
+// neither needs the output to be read back from disk. The round trip decodes the output with the reverse conversion
+// and compares it with the input that was converted; both streams may be fed in pieces of any size.
+class output_check_t
+{
+public:
+    // `reverse` converts the output back into the input encoding, nullptr to skip the round trip.
+    // throws std::runtime_error if the hash cannot be set up
+    output_check_t(checksum_t algorithm, std::unique_ptr<conversion_t> reverse);
+    ~output_check_t();
+    output_check_t(const output_check_t &) = delete;
+    output_check_t &operator=(const output_check_t &) = delete;
+
+    // Text that was converted, in order; ignored without round trip
+    void input(const char *data, size_t size);
+    // Converted text, in order
+    void output(const char *data, size_t size);
+
+    // Lowercase hex digest, empty without checksum. Ends the output.
+    std::string digest();
+    // Whether the output decodes back to the input, nullopt without round trip. Ends the output.
+    std::optional<bool> verified();
+
+private:
+    void compare();
+
+    checksum_t algorithm_;
+    struct hash_t;
+    std::unique_ptr<hash_t> hash_;
+    std::string digest_;
+    bool finished_ = false;
+
+    std::unique_ptr<conversion_t> reverse_;
+    bool mismatch_ = false;
+    bool finished_reverse_ = false;
+    std::vector<char> expected_; // input not matched yet
+    std::vector<char> undecoded_; // output ending in an incomplete character
+    std::vector<char> decoded_;
+};
+
+#endif // OUTPUT_CHECK_H
@@ -0,0 +1,305 @@
+#include "output_file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+size_t page_align(size_t size)
+{
+    static const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return (std::max<size_t>(size, 1) + page - 1) / page * page;
+}
+
+// Open directories of the output tree, shared by all workers. Handles stay valid while in use even if the cache
+// drops them, and the cache is emptied when it grows past `capacity` so that deep trees do not run out of descriptors.
+class output_dirs_t
+{
+public:
+    struct dir_t
+    {
+        int fd;
+        ~dir_t()
+        {
+            ::close(fd);
+        }
+    };
+
+    // nullptr with errno set if the directory is missing (and not `create`) or cannot be opened
+    std::shared_ptr<dir_t> open(const std::filesystem::path &dir, bool create)
+    {
+        {
+            std::lock_guard lck(mtx_);
+            if (const auto it = dirs_.find(dir); it != dirs_.end()) {
+                return it->second;
+            }
+        }
+        int fd;
+        if (!dir.has_relative_path()) {
+            fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+            const auto parent = open(dir.parent_path(), create);
+            if (!parent) {
+                return nullptr;
+            }
+            fd = ::openat(parent->fd, dir.filename().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0 && errno == ENOENT && create) {
+                // another worker may be creating it at the same time
+                if (::mkdirat(parent->fd, dir.filename().c_str(), 0777) == 0 || errno == EEXIST) {
+                    fd = ::openat(parent->fd, dir.filename().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                }
+            }
+        }
+        if (fd < 0) {
+            return nullptr;
+        }
+        auto handle = std::make_shared<dir_t>(fd);
+        std::lock_guard lck(mtx_);
+        if (dirs_.size() >= capacity) {
+            dirs_.clear();
+        }
+        return dirs_.emplace(dir, std::move(handle)).first->second;
+    }
+
+private:
+    static constexpr size_t capacity = 256;
+
+    std::mutex mtx_;
+    std::map<std::filesystem::path, std::shared_ptr<dir_t>> dirs_;
+};
+
+output_dirs_t g_output_dirs;
+
+// directory part of `path` in the form used as cache key
+std::filesystem::path directory_of(const std::filesystem::path &path)
+{
+    std::filesystem::path dir = path.parent_path().lexically_normal();
+    if (dir.has_relative_path() && !dir.has_filename()) {
+        dir = dir.parent_path();
+    }
+    return dir;
+}
+
+int reserve(int fd, size_t size)
+{
+#ifdef __linux__
+    return ::fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0 ? 0 : errno;
+#else
+    return ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+#endif
+}
+}
+
+int create_output(const std::filesystem::path &path, int flags, mode_t mode)
+{
+    const auto dir = g_output_dirs.open(directory_of(path), true);
+    if (!dir) {
+        return -1;
+    }
+    return ::openat(dir->fd, path.filename().c_str(), O_CREAT | O_TRUNC | O_CLOEXEC | flags, mode);
+}
+
+void write_output(const std::filesystem::path &path, const char *data, size_t size)
+{
+    const int fd = create_output(path, O_WRONLY);
+    if (fd < 0) {
+        throw std::runtime_error("cannot open file: " + path.string() + ": " + std::strerror(errno));
+    }
+    while (size > 0) {
+        const ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error("failed to write: " + path.string() + ": " + std::strerror(error));
+        }
+        data += n;
+        size -= n;
+    }
+    if (::close(fd) != 0) {
+        throw std::runtime_error("failed to write: " + path.string() + ": " + std::strerror(errno));
+    }
+}
+
+void copy_output(const std::filesystem::path &input, const std::filesystem::path &path)
+{
+    const int in = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in < 0 || ::fstat(in, &st) != 0) {
+        const int error = errno;
+        if (in >= 0) {
+            ::close(in);
+        }
+        throw std::runtime_error("cannot open file: " + input.string() + ": " + std::strerror(error));
+    }
+    const int out = create_output(path, O_WRONLY, st.st_mode & 07777);
+    if (out < 0) {
+        const int error = errno;
+        ::close(in);
+        throw std::runtime_error("cannot open file: " + path.string() + ": " + std::strerror(error));
+    }
+    // an existing output keeps its mode through O_TRUNC, so set it on the descriptor
+    int error = ::fchmod(out, st.st_mode & 07777) == 0 ? 0 : errno;
+    std::vector<char> buffer;
+    for (off_t copied = 0; error == 0 && copied < st.st_size;) {
+#ifdef __linux__
+        ssize_t n = ::copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(st.st_size - copied), 0);
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+#else
+        ssize_t n = -1;
+#endif
+        {
+            buffer.resize(1 << 20);
+            n = ::read(in, buffer.data(), buffer.size());
+            for (ssize_t written = 0, w; n > 0 && written < n; written += w) {
+                if ((w = ::write(out, buffer.data() + written, n - written)) < 0) {
+                    n = -1;
+                    break;
+                }
+            }
+        }
+        if (n < 0) {
+            error = errno == EINTR ? 0 : errno;
+        } else if (n == 0) {
+            break;
+        } else {
+            copied += n;
+        }
+    }
+    ::close(in);
+    if (::close(out) != 0 && error == 0) {
+        error = errno;
+    }
+    if (error != 0) {
+        throw std::runtime_error("failed to write: " + path.string() + ": " + std::strerror(error));
+    }
+}
+
+std::unique_ptr<mapped_output_t> mapped_output_t::open(const std::filesystem::path &path, size_t capacity)
+{
+    const int fd = create_output(path, O_RDWR);
+    if (fd < 0) {
+        return nullptr;
+    }
+    // FIFOs, terminals and devices keep the ordinary write path
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return nullptr;
+    }
+    const size_t mapped = page_align(capacity);
+    void *data = MAP_FAILED;
+    if (reserve(fd, mapped) == 0) {
+        data = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        ::close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<mapped_output_t>(new mapped_output_t(fd, static_cast<char *>(data), mapped));
+}
+
+mapped_output_t::mapped_output_t(int fd, char *data, size_t mapped)
+    : fd_(fd)
+    , data_(data)
+    , mapped_(mapped)
+{
+}
+
+mapped_output_t::~mapped_output_t()
+{
+    if (data_ != nullptr) {
+        ::munmap(data_, mapped_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void mapped_output_t::resize(size_t size)
+{
+    if (size > mapped_) {
+        const size_t mapped = page_align(std::max(size, mapped_ << 1));
+        if (const int error = reserve(fd_, mapped); error != 0) {
+            throw std::runtime_error(std::string("cannot grow output file: ") + std::strerror(error));
+        }
+#ifdef __linux__
+        void *data = ::mremap(data_, mapped_, mapped, MREMAP_MAYMOVE);
+#else
+        ::munmap(data_, mapped_);
+        void *data = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+#endif
+        if (data == MAP_FAILED) {
+            data_ = nullptr;
+            throw std::runtime_error(std::string("cannot map output file: ") + std::strerror(errno));
+        }
+        data_ = static_cast<char *>(data);
+        mapped_ = mapped;
+    }
+    size_ = size;
+}
+
+void mapped_output_t::commit()
+{
+    ::munmap(data_, mapped_);
+    data_ = nullptr;
+    // drop the reserved space past the converted data
+    if (::ftruncate(fd_, static_cast<off_t>(size_)) != 0) {
+        throw std::runtime_error(std::string("cannot truncate output file: ") + std::strerror(errno));
+    }
+    ::close(fd_);
+    fd_ = -1;
+}
+
+bool is_pipe(const std::filesystem::path &path)
+{
+    const auto dir = g_output_dirs.open(directory_of(path), false);
+    struct stat st;
+    return dir && ::fstatat(dir->fd, path.filename().c_str(), &st, 0) == 0 && S_ISFIFO(st.st_mode);
+}
+
+bool splice_to_pipe(const std::filesystem::path &input, size_t offset, const std::filesystem::path &output)
+{
+#ifdef __linux__
+    const int in = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    const int out = create_output(output, O_WRONLY);
+    if (out < 0) {
+        const int error = errno;
+        ::close(in);
+        errno = error;
+        return false;
+    }
+    loff_t position = static_cast<loff_t>(offset);
+    ssize_t n;
+    do {
+        n = ::splice(in, &position, out, nullptr, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n > 0 || (n < 0 && errno == EINTR));
+    const int error = errno;
+    ::close(in);
+    ::close(out);
+    if (n < 0 && position != static_cast<loff_t>(offset)) {
+        throw std::runtime_error("failed to write: " + output.string() + ": " + std::strerror(error));
+    }
+    errno = error;
+    return n == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
@@ -0,0 +1,63 @@
+#ifndef OUTPUT_FILE_H
+#define OUTPUT_FILE_H
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+
+#include <sys/types.h>
+
+// Output file written through a shared mapping, so that converters store straight into the page cache instead of
+// into a buffer that write(2) copies once more. The space is reserved with fallocate(2) before it is mapped,
+// since running out of disk under a mapping raises SIGBUS rather than an error.
+class mapped_output_t
+{
+public:
+    // nullptr if the destination cannot be mapped (not a regular file, no preallocation support),
+    // in which case the caller writes it the buffered way
+    static std::unique_ptr<mapped_output_t> open(const std::filesystem::path &path, size_t capacity);
+    ~mapped_output_t();
+
+    char *data()
+    {
+        return data_;
+    }
+    size_t size() const
+    {
+        return size_;
+    }
+    // throws std::runtime_error if the file cannot grow
+    void resize(size_t size);
+    // unmap and truncate the file to size(); throws std::runtime_error
+    void commit();
+
+private:
+    mapped_output_t(int fd, char *data, size_t mapped);
+
+    int fd_;
+    char *data_;
+    size_t size_ = 0;
+    size_t mapped_;
+};
+
+// Create (or truncate) the output file `path` with O_CREAT | O_TRUNC | O_CLOEXEC | `flags`, creating missing parent
+// directories. The file is opened with openat(2) relative to a descriptor of its directory which is kept open for the
+// following outputs, so that the kernel does not resolve the whole output directory chain again for every file.
+// Returns the descriptor, or -1 with errno set.
+int create_output(const std::filesystem::path &path, int flags, mode_t mode = 0666);
+
+// Write `data` to the output file `path`; throws std::runtime_error
+void write_output(const std::filesystem::path &path, const char *data, size_t size);
+
+// Copy `input` to the output file `path` with the permissions of `input`; throws std::runtime_error
+void copy_output(const std::filesystem::path &input, const std::filesystem::path &path);
+
+// Whether `path` is a FIFO or pipe (a named FIFO, or /dev/stdout of a pipeline)
+bool is_pipe(const std::filesystem::path &path);
+
+// Move the bytes of `input` from `offset` on into the pipe `output` with splice(2), without copying them through
+// userspace. Returns false with errno set if the kernel cannot splice them and nothing has been written yet;
+// throws std::runtime_error if the transfer breaks off midway.
+bool splice_to_pipe(const std::filesystem::path &input, size_t offset, const std::filesystem::path &output);
+
+#endif // OUTPUT_FILE_H
@@ -0,0 +1,204 @@
+#include "simd.h"
+
+#include <bit>
+#include <stdexcept>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_X86 1
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace simd
+{
+namespace
+{
+size_t ascii_span_scalar(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4])
+{
+    size_t i = 0;
+    for (; i < n; ++i) {
+        const std::uint8_t b = p[i];
+        if (b >= 0x80 || b == exceptions[0] || b == exceptions[1] || b == exceptions[2] || b == exceptions[3]) {
+            break;
+        }
+    }
+    return i;
+}
+
+void count_nuls_scalar(const std::uint8_t *p, size_t n, size_t nuls[4])
+{
+    for (size_t i = 0; i < n; ++i) {
+        nuls[i & 3] += p[i] == 0;
+    }
+}
+
+#if SIMD_X86
+SIMD_TARGET("sse4.2,popcnt")
+size_t ascii_span_sse4_2(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4])
+{
+    const __m128i e0 = _mm_set1_epi8(static_cast<char>(exceptions[0]));
+    const __m128i e1 = _mm_set1_epi8(static_cast<char>(exceptions[1]));
+    const __m128i e2 = _mm_set1_epi8(static_cast<char>(exceptions[2]));
+    const __m128i e3 = _mm_set1_epi8(static_cast<char>(exceptions[3]));
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        const __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, e0), _mm_cmpeq_epi8(v, e1)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(v, e2), _mm_cmpeq_epi8(v, e3)));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(v, hit)));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return i + ascii_span_scalar(p + i, n - i, exceptions);
+}
+
+SIMD_TARGET("sse4.2,popcnt")
+void count_nuls_sse4_2(const std::uint8_t *p, size_t n, size_t nuls[4])
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+        for (int k = 0; k < 4; ++k) {
+            nuls[k] += std::popcount(mask & (0x1111u << k));
+        }
+    }
+    count_nuls_scalar(p + i, n - i, nuls);
+}
+
+SIMD_TARGET("avx2,popcnt")
+size_t ascii_span_avx2(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4])
+{
+    const __m256i e0 = _mm256_set1_epi8(static_cast<char>(exceptions[0]));
+    const __m256i e1 = _mm256_set1_epi8(static_cast<char>(exceptions[1]));
+    const __m256i e2 = _mm256_set1_epi8(static_cast<char>(exceptions[2]));
+    const __m256i e3 = _mm256_set1_epi8(static_cast<char>(exceptions[3]));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        const __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, e0), _mm256_cmpeq_epi8(v, e1)),
+                                            _mm256_or_si256(_mm256_cmpeq_epi8(v, e2), _mm256_cmpeq_epi8(v, e3)));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_or_si256(v, hit)));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return i + ascii_span_sse4_2(p + i, n - i, exceptions);
+}
+
+SIMD_TARGET("avx2,popcnt")
+void count_nuls_avx2(const std::uint8_t *p, size_t n, size_t nuls[4])
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        const unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)));
+        for (int k = 0; k < 4; ++k) {
+            nuls[k] += std::popcount(mask & (0x11111111u << k));
+        }
+    }
+    count_nuls_sse4_2(p + i, n - i, nuls);
+}
+
+// AVX-512BW compares straight into 64-bit masks, and a masked load covers the tail without a scalar loop
+SIMD_TARGET("avx512f,avx512bw,popcnt")
+size_t ascii_span_avx512(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4])
+{
+    const __m512i e0 = _mm512_set1_epi8(static_cast<char>(exceptions[0]));
+    const __m512i e1 = _mm512_set1_epi8(static_cast<char>(exceptions[1]));
+    const __m512i e2 = _mm512_set1_epi8(static_cast<char>(exceptions[2]));
+    const __m512i e3 = _mm512_set1_epi8(static_cast<char>(exceptions[3]));
+    for (size_t i = 0; i < n; i += 64) {
+        const __mmask64 valid = n - i >= 64 ? ~__mmask64(0) : (__mmask64(1) << (n - i)) - 1;
+        const __m512i v = _mm512_maskz_loadu_epi8(valid, p + i);
+        const __mmask64 stop = (_mm512_movepi8_mask(v) | _mm512_cmpeq_epi8_mask(v, e0) | _mm512_cmpeq_epi8_mask(v, e1) |
+                                _mm512_cmpeq_epi8_mask(v, e2) | _mm512_cmpeq_epi8_mask(v, e3)) & valid;
+        if (stop != 0) {
+            return i + std::countr_zero(static_cast<std::uint64_t>(stop));
+        }
+    }
+    return n;
+}
+
+SIMD_TARGET("avx512f,avx512bw,popcnt")
+void count_nuls_avx512(const std::uint8_t *p, size_t n, size_t nuls[4])
+{
+    const __m512i zero = _mm512_setzero_si512();
+    for (size_t i = 0; i < n; i += 64) {
+        const __mmask64 valid = n - i >= 64 ? ~__mmask64(0) : (__mmask64(1) << (n - i)) - 1;
+        const __m512i v = _mm512_maskz_loadu_epi8(valid, p + i);
+        const std::uint64_t mask = _mm512_cmpeq_epi8_mask(v, zero) & valid;
+        for (int k = 0; k < 4; ++k) {
+            nuls[k] += std::popcount(mask & (0x1111111111111111ull << k));
+        }
+    }
+}
+#endif
+
+const kernels_t kernels[] = {
+    {ascii_span_scalar, count_nuls_scalar},
+#if SIMD_X86
+    {ascii_span_sse4_2, count_nuls_sse4_2},
+    {ascii_span_avx2, count_nuls_avx2},
+    {ascii_span_avx512, count_nuls_avx512},
+#endif
+};
+
+const char *const names[] = {"scalar", "sse4.2", "avx2", "avx512"};
+
+level_t current = detect();
+}
+
+const kernels_t *active = &kernels[static_cast<int>(current)];
+
+level_t detect()
+{
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return level_t::avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return level_t::avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        return level_t::sse4_2;
+    }
+#endif
+    return level_t::scalar;
+}
+
+level_t selected()
+{
+    return current;
+}
+
+const char *name(level_t level)
+{
+    return names[static_cast<int>(level)];
+}
+
+void select(const std::string &level)
+{
+    const level_t best = detect();
+    if (level == "auto") {
+        current = best;
+    } else {
+        int index = 0;
+        while (index < static_cast<int>(std::size(names)) && level != names[index]) {
+            ++index;
+        }
+        if (index == static_cast<int>(std::size(names))) {
+            throw std::invalid_argument("unknown SIMD level: " + level);
+        }
+        if (index > static_cast<int>(best)) {
+            throw std::invalid_argument(level + " is not supported by this CPU, which supports up to " + name(best));
+        }
+        current = static_cast<level_t>(index);
+    }
+    active = &kernels[static_cast<int>(current)];
+}
+}
@@ -0,0 +1,61 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Vectorised kernels, compiled for several instruction sets and picked at startup from what the CPU supports,
+// so that a single binary runs everywhere and still uses the widest vectors available.
+namespace simd
+{
+enum class level_t {
+    scalar,
+    sse4_2,
+    avx2,
+    avx512,
+};
+
+struct kernels_t
+{
+    size_t (*ascii_span)(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4]);
+    void (*count_nuls)(const std::uint8_t *p, size_t n, size_t nuls[4]);
+};
+
+extern const kernels_t *active;
+
+// Widest level this CPU supports
+level_t detect();
+level_t selected();
+const char *name(level_t level);
+// "auto" or a level name; throws std::invalid_argument if unknown or not supported by this CPU
+void select(const std::string &level);
+
+// Length of the leading run of ASCII bytes of `p` which are none of `exceptions`
+inline size_t ascii_span(const std::uint8_t *p, size_t n, const std::uint8_t exceptions[4])
+{
+    // runs between non-ASCII characters are mostly short, finish those within one word before the indirect call
+    if constexpr (std::endian::native == std::endian::little) {
+        if (n >= 8 && exceptions[0] == 0xFF) {
+            std::uint64_t word;
+            std::memcpy(&word, p, 8);
+            const std::uint64_t high = word & 0x8080808080808080ull;
+            if (high != 0) {
+                return std::countr_zero(high) / 8;
+            }
+            return 8 + active->ascii_span(p + 8, n - 8, exceptions);
+        }
+    }
+    return active->ascii_span(p, n, exceptions);
+}
+
+// Add the NUL bytes of `p` to `nuls` by position mod 4, `n` being a multiple of 4
+inline void count_nuls(const std::uint8_t *p, size_t n, size_t nuls[4])
+{
+    active->count_nuls(p, n, nuls);
+}
+}
+
+#endif // SIMD_H
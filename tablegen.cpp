@@ -0,0 +1,388 @@
+// chconv_tablegen: enumerate a charset through iconv and emit the native decode/encode tables as a header.
+//
+// usage: chconv_tablegen <charset> <identifier> <output header>
+//        chconv_tablegen --dispatch <output header> <identifier>=<charset>[,<alias>...]...
+//
+// Every byte sequence of up to three bytes and every code point is run through iconv itself,
+// so the generated tables reproduce the linked iconv's mapping byte for byte. A charset the linked
+// iconv cannot represent this way (stateful, combining or non-BMP) gets an empty table and a warning,
+// and is left to iconv at run time. The dispatch header maps every name and alias to its table.
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <iconv.h>
+
+namespace
+{
+constexpr std::uint16_t decode_invalid = 0xFFFF;
+constexpr std::uint16_t decode_link = 0xD800;
+constexpr std::uint32_t encode_ignored = 0x100;
+constexpr size_t max_sequence = 3;
+
+enum class decode_result {
+    ok,
+    incomplete,
+    invalid,
+};
+
+struct iconv_handle_t
+{
+    iconv_handle_t(const char *to, const char *from)
+        : cd(iconv_open(to, from))
+    {
+        if (cd == (iconv_t)-1) {
+            throw std::runtime_error(std::string("iconv does not support ") + from + " -> " + to);
+        }
+    }
+    ~iconv_handle_t()
+    {
+        iconv_close(cd);
+    }
+    iconv_t cd;
+};
+
+class table_builder_t
+{
+public:
+    explicit table_builder_t(const std::string &charset)
+        : charset_(charset)
+        , decoder_("UTF-32LE", charset.c_str())
+        , encoder_(charset.c_str(), "UTF-32LE")
+    {
+    }
+
+    void build()
+    {
+        std::string prefix;
+        build_decode_page(prefix);
+        build_encode_pages();
+        collect_ascii_exceptions();
+    }
+
+    void write(std::ostream &os, const std::string &identifier) const
+    {
+        os << "// Generated by chconv_tablegen from iconv's " << charset_ << " mapping, do not edit.\n"
+           << "#pragma once\n\n"
+           << "#include \"native_codec.h\"\n\n"
+           << "namespace native::tables\n{\n"
+           << "namespace " << identifier << "_data\n{\n";
+
+        os << "alignas(64) inline constexpr std::uint16_t decode[" << decode_pages_.size() << "][256] = {\n";
+        for (const auto &page : decode_pages_) {
+            write_page(os, page.data());
+        }
+        os << "};\n";
+
+        os << "alignas(64) inline constexpr std::uint16_t encode_index[" << encode_index_.size() << "] = {\n";
+        for (size_t i = 0; i < encode_index_.size(); i += 256) {
+            write_entries(os, encode_index_.data() + i, 4);
+        }
+        os << "};\n";
+
+        os << "alignas(64) inline constexpr std::uint32_t encode[" << std::max<size_t>(encode_pages_.size(), 1) << "][256] = {\n";
+        for (const auto &page : encode_pages_) {
+            write_page(os, page.data());
+        }
+        if (encode_pages_.empty()) {
+            os << "    {},\n";
+        }
+        os << "};\n";
+
+        // single-byte charsets also get the direct byte -> UTF-8 table
+        const bool single_byte = decode_pages_.size() == 1;
+        if (single_byte) {
+            std::array<std::uint32_t, 256> utf8{};
+            for (size_t b = 0; b < 256; ++b) {
+                utf8[b] = utf8_entry(decode_pages_[0][b]);
+            }
+            os << "alignas(64) inline constexpr std::uint32_t utf8[256] = {\n";
+            write_entries(os, utf8.data(), 4);
+            os << "};\n";
+        }
+        os << "}\n\n";
+
+        os << "inline constexpr charset_t " << identifier << "{\n"
+           << "    \"" << charset_ << "\",\n"
+           << "    " << identifier << "_data::decode,\n"
+           << "    " << identifier << "_data::encode_index,\n"
+           << "    " << identifier << "_data::encode,\n"
+           << "    " << (single_byte ? identifier + "_data::utf8" : "nullptr") << ",\n"
+           << "    {";
+        for (size_t i = 0; i < 4; ++i) {
+            os << (i ? ", " : "") << "0x" << std::hex << (i < ascii_exceptions_.size() ? ascii_exceptions_[i] : 0xFF) << std::dec;
+        }
+        os << "},\n"
+           << "    " << (ascii_exceptions_.size() <= 4 ? "true" : "false") << ",\n"
+           << "};\n"
+           << "}\n";
+    }
+
+private:
+    template<typename T>
+    static void write_entries(std::ostream &os, const T *page, int indent)
+    {
+        for (size_t i = 0; i < 256; ++i) {
+            os << (i % 16 == 0 ? std::string(indent, ' ') : " ") << "0x" << std::hex << static_cast<std::uint32_t>(page[i]) << std::dec << (i % 16 == 15 ? ",\n" : ",");
+        }
+    }
+
+    template<typename T>
+    static void write_page(std::ostream &os, const T *page)
+    {
+        os << "    {\n";
+        write_entries(os, page, 8);
+        os << "    },\n";
+    }
+
+    // UTF-8 bytes of `cp` from bit 8 upwards and the byte count in the low 8 bits, 0 if unmapped
+    static std::uint32_t utf8_entry(std::uint16_t cp)
+    {
+        if (cp == decode_invalid) {
+            return 0;
+        } else if (cp < 0x80) {
+            return (static_cast<std::uint32_t>(cp) << 8) | 1;
+        } else if (cp < 0x800) {
+            return ((0xC0u | (cp >> 6)) << 8) | ((0x80u | (cp & 0x3F)) << 16) | 2;
+        }
+        return ((0xE0u | (cp >> 12)) << 8) | ((0x80u | ((cp >> 6) & 0x3F)) << 16) | ((0x80u | (cp & 0x3F)) << 24) | 3;
+    }
+
+    decode_result decode(const std::string &bytes, std::uint32_t &cp)
+    {
+        iconv(decoder_.cd, nullptr, nullptr, nullptr, nullptr);
+        char *in = const_cast<char *>(bytes.data());
+        size_t in_left = bytes.size();
+        std::uint32_t out[4];
+        char *out_ptr = reinterpret_cast<char *>(out);
+        size_t out_left = sizeof(out);
+        if (iconv(decoder_.cd, &in, &in_left, &out_ptr, &out_left) == (size_t)-1) {
+            if (errno == EINVAL) {
+                return decode_result::incomplete;
+            }
+            if (errno == EILSEQ) {
+                return decode_result::invalid;
+            }
+            throw std::runtime_error(charset_ + ": unexpected iconv failure: " + std::strerror(errno));
+        }
+        const size_t produced = sizeof(out) - out_left;
+        if (produced != 4) {
+            throw std::runtime_error(charset_ + ": a sequence does not decode to exactly one character, not representable");
+        }
+        const unsigned char *le = reinterpret_cast<const unsigned char *>(out);
+        cp = le[0] | (le[1] << 8) | (le[2] << 16) | (static_cast<std::uint32_t>(le[3]) << 24);
+        if (cp > 0xFFFF || (cp >= 0xD800 && cp < 0xE000)) {
+            throw std::runtime_error(charset_ + ": decodes outside the BMP, not representable");
+        }
+        return decode_result::ok;
+    }
+
+    // returns the index of the page built for `prefix`
+    size_t build_decode_page(std::string &prefix)
+    {
+        const size_t index = decode_pages_.size();
+        decode_pages_.emplace_back();
+        for (size_t b = 0; b < 256; ++b) {
+            prefix.push_back(static_cast<char>(b));
+            std::uint32_t cp = 0;
+            std::uint16_t entry = decode_invalid;
+            switch (decode(prefix, cp)) {
+            case decode_result::ok:
+                entry = static_cast<std::uint16_t>(cp);
+                break;
+            case decode_result::incomplete:
+                if (prefix.size() == max_sequence) {
+                    throw std::runtime_error(charset_ + ": sequences longer than 3 bytes, not representable");
+                }
+                entry = static_cast<std::uint16_t>(decode_link + build_decode_page(prefix));
+                if (entry >= 0xE000) {
+                    throw std::runtime_error(charset_ + ": too many decode pages");
+                }
+                break;
+            case decode_result::invalid:
+                break;
+            }
+            decode_pages_[index][b] = entry;
+            prefix.pop_back();
+        }
+        return index;
+    }
+
+    void build_encode_pages()
+    {
+        encode_index_.fill(0);
+        for (std::uint32_t cp = 0; cp <= 0x10FFFF; ++cp) {
+            if (cp >= 0xD800 && cp < 0xE000) {
+                continue;
+            }
+            iconv(encoder_.cd, nullptr, nullptr, nullptr, nullptr);
+            char utf32le[4] = {static_cast<char>(cp), static_cast<char>(cp >> 8), static_cast<char>(cp >> 16), 0};
+            char *in = utf32le;
+            size_t in_left = sizeof(utf32le);
+            unsigned char out[8];
+            char *out_ptr = reinterpret_cast<char *>(out);
+            size_t out_left = sizeof(out);
+            if (iconv(encoder_.cd, &in, &in_left, &out_ptr, &out_left) == (size_t)-1) {
+                if (errno == EILSEQ) {
+                    continue;
+                }
+                throw std::runtime_error(charset_ + ": unexpected iconv failure: " + std::strerror(errno));
+            }
+            const size_t produced = sizeof(out) - out_left;
+            if (produced > max_sequence) {
+                throw std::runtime_error(charset_ + ": encodes to more than 3 bytes, not representable");
+            }
+            // some iconv implementations accept and drop characters such as the Unicode tags
+            std::uint32_t entry = produced == 0 ? encode_ignored : static_cast<std::uint32_t>(produced);
+            for (size_t i = 0; i < produced; ++i) {
+                entry |= static_cast<std::uint32_t>(out[i]) << (8 * (i + 1));
+            }
+            auto &page = encode_index_[cp >> 8];
+            if (page == 0) {
+                encode_pages_.emplace_back();
+                page = static_cast<std::uint16_t>(encode_pages_.size());
+            }
+            encode_pages_[page - 1][cp & 0xFF] = entry;
+            if (cp < 0x80) {
+                ascii_encoding_[cp] = entry;
+            }
+        }
+    }
+
+    void collect_ascii_exceptions()
+    {
+        for (std::uint32_t b = 0; b < 0x80; ++b) {
+            if (decode_pages_[0][b] != b || ascii_encoding_[b] != ((b << 8) | 1)) {
+                ascii_exceptions_.push_back(b);
+            }
+        }
+    }
+
+    std::string charset_;
+    iconv_handle_t decoder_;
+    iconv_handle_t encoder_;
+    std::vector<std::array<std::uint16_t, 256>> decode_pages_;
+    std::array<std::uint16_t, 0x1100> encode_index_{};
+    std::vector<std::array<std::uint32_t, 256>> encode_pages_;
+    std::array<std::uint32_t, 0x80> ascii_encoding_{};
+    std::vector<std::uint32_t> ascii_exceptions_;
+};
+
+// Header for a charset that has no native tables, so that the dispatch table can still refer to it
+void write_unsupported(std::ostream &os, const std::string &charset, const std::string &identifier, const std::string &reason)
+{
+    os << "// Generated by chconv_tablegen, do not edit.\n"
+       << "// " << charset << " has no native tables: " << reason << "\n"
+       << "#pragma once\n\n"
+       << "#include \"native_codec.h\"\n\n"
+       << "namespace native::tables\n{\n"
+       << "inline constexpr charset_t " << identifier << "{\"" << charset << "\", nullptr, nullptr, nullptr, nullptr, {0xff, 0xff, 0xff, 0xff}, false};\n"
+       << "}\n";
+}
+
+std::string to_upper(std::string str)
+{
+    for (auto &c : str) {
+        c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    }
+    return str;
+}
+
+// Sorted upper-case names for binary search in native::find_charset()
+void write_dispatch(std::ostream &os, int argc, char *argv[])
+{
+    std::vector<std::string> identifiers;
+    std::vector<std::pair<std::string, std::string>> names;
+    for (int i = 0; i < argc; ++i) {
+        const std::string spec = argv[i];
+        const size_t eq = spec.find('=');
+        if (eq == std::string::npos) {
+            throw std::runtime_error("invalid dispatch entry: " + spec);
+        }
+        identifiers.push_back(spec.substr(0, eq));
+        size_t begin = eq + 1;
+        while (begin <= spec.size()) {
+            size_t end = spec.find(',', begin);
+            if (end == std::string::npos) {
+                end = spec.size();
+            }
+            if (end > begin) {
+                names.emplace_back(to_upper(spec.substr(begin, end - begin)), identifiers.back());
+            }
+            begin = end + 1;
+        }
+    }
+    std::sort(names.begin(), names.end());
+    for (size_t i = 1; i < names.size(); ++i) {
+        if (names[i].first == names[i - 1].first) {
+            throw std::runtime_error("charset name listed twice: " + names[i].first);
+        }
+    }
+
+    os << "// Generated by chconv_tablegen, do not edit.\n"
+       << "#pragma once\n\n"
+       << "#include <string_view>\n\n";
+    for (const auto &identifier : identifiers) {
+        os << "#include \"tables/" << identifier << ".h\"\n";
+    }
+    os << "\nnamespace native::tables\n{\n"
+       << "struct dispatch_entry_t\n{\n"
+       << "    std::string_view name;\n"
+       << "    const charset_t *charset;\n"
+       << "};\n\n"
+       << "inline constexpr dispatch_entry_t dispatch[] = {\n";
+    for (const auto &[name, identifier] : names) {
+        os << "    {\"" << name << "\", &" << identifier << "},\n";
+    }
+    os << "};\n"
+       << "}\n";
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 3 && std::strcmp(argv[1], "--dispatch") == 0) {
+        try {
+            std::ofstream output(argv[2], std::ios::binary);
+            if (!output.is_open()) {
+                std::cerr << "cannot open file: " << argv[2] << '\n';
+                return 1;
+            }
+            write_dispatch(output, argc - 3, argv + 3);
+            return 0;
+        } catch (const std::exception &ex) {
+            std::cerr << "chconv_tablegen: " << ex.what() << '\n';
+            return 1;
+        }
+    }
+    if (argc != 4) {
+        std::cerr << "usage: chconv_tablegen <charset> <identifier> <output header>\n"
+                  << "       chconv_tablegen --dispatch <output header> <identifier>=<charset>[,<alias>...]...\n";
+        return 1;
+    }
+    std::ofstream output(argv[3], std::ios::binary);
+    if (!output.is_open()) {
+        std::cerr << "cannot open file: " << argv[3] << '\n';
+        return 1;
+    }
+    try {
+        table_builder_t builder(argv[1]);
+        builder.build();
+        builder.write(output, argv[2]);
+    } catch (const std::exception &ex) {
+        std::cerr << "chconv_tablegen: warning: " << ex.what() << ", falling back to iconv\n";
+        output.close();
+        output.open(argv[3], std::ios::binary | std::ios::trunc);
+        write_unsupported(output, argv[1], argv[2], ex.what());
+    }
+    return 0;
+}
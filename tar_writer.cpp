@@ -0,0 +1,223 @@
+#include "tar_writer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
+
+namespace
+{
+constexpr size_t block_size = 512;
+// largest size the 11 octal digits of the ustar size field hold, 8 GiB - 1
+constexpr unsigned long long max_ustar_size = 077777777777ull;
+
+struct ustar_header_t
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+static_assert(sizeof(ustar_header_t) == block_size);
+
+// zero padded octal number filling all but the terminating NUL of the field
+void put_octal(char *field, size_t width, unsigned long long value)
+{
+    for (size_t i = width - 1; i-- > 0; value >>= 3) {
+        field[i] = static_cast<char>('0' + (value & 7));
+    }
+    field[width - 1] = '\0';
+}
+
+// Split a name at a '/' into the 155 byte prefix and 100 byte name fields, false if it does not fit
+bool split_name(const std::string &name, ustar_header_t &header)
+{
+    if (name.size() <= sizeof(header.name)) {
+        std::memcpy(header.name, name.data(), name.size());
+        return true;
+    }
+    for (size_t slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+        if (slash <= sizeof(header.prefix) && name.size() - slash - 1 <= sizeof(header.name)) {
+            std::memcpy(header.prefix, name.data(), slash);
+            std::memcpy(header.name, name.data() + slash + 1, name.size() - slash - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// "<length> <key>=<value>\n", the length counting its own digits
+std::string pax_record(const std::string &key, const std::string &value)
+{
+    const std::string tail = " " + key + "=" + value + "\n";
+    size_t length = tail.size();
+    while (std::to_string(length).size() + tail.size() != length) {
+        length = std::to_string(length).size() + tail.size();
+    }
+    return std::to_string(length) + tail;
+}
+}
+
+#if WITH_ZLIB
+struct tar_writer_t::deflate_t
+{
+    z_stream stream{};
+    std::vector<char> buffer = std::vector<char>(256 * 1024);
+};
+#else
+struct tar_writer_t::deflate_t
+{
+};
+#endif
+
+bool tar_writer_t::gzip_available()
+{
+#if WITH_ZLIB
+    return true;
+#else
+    return false;
+#endif
+}
+
+tar_writer_t::tar_writer_t(const std::filesystem::path &path, bool gzip)
+    : path_(path)
+    , file_(path, std::ios::binary)
+{
+    if (!file_.is_open()) {
+        throw std::runtime_error("cannot open file: " + path.string());
+    }
+    if (gzip) {
+#if WITH_ZLIB
+        deflate_ = std::make_unique<deflate_t>();
+        // 15 + 16 selects the gzip wrapper
+        if (deflateInit2(&deflate_->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("failed to initialise gzip compression");
+        }
+#else
+        throw std::runtime_error("gzip compression requires a build with zlib");
+#endif
+    }
+}
+
+tar_writer_t::~tar_writer_t()
+{
+#if WITH_ZLIB
+    if (deflate_) {
+        deflateEnd(&deflate_->stream);
+    }
+#endif
+}
+
+void tar_writer_t::write(const char *data, size_t size, bool flush)
+{
+    if (!deflate_) {
+        if (!file_.write(data, size)) {
+            throw std::runtime_error("failed to write: " + path_.string());
+        }
+        return;
+    }
+#if WITH_ZLIB
+    z_stream &stream = deflate_->stream;
+    // avail_in is a uInt, so larger data is fed in pieces
+    do {
+        const size_t piece = std::min<size_t>(size, UINT_MAX);
+        const bool last = flush && piece == size;
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream.avail_in = static_cast<uInt>(piece);
+        int result;
+        do {
+            stream.next_out = reinterpret_cast<Bytef *>(deflate_->buffer.data());
+            stream.avail_out = static_cast<uInt>(deflate_->buffer.size());
+            result = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+            if (result == Z_STREAM_ERROR) {
+                throw std::runtime_error("gzip compression failed");
+            }
+            if (!file_.write(deflate_->buffer.data(), deflate_->buffer.size() - stream.avail_out)) {
+                throw std::runtime_error("failed to write: " + path_.string());
+            }
+        } while (stream.avail_out == 0 || (last && result != Z_STREAM_END));
+        data += piece;
+        size -= piece;
+    } while (size > 0);
+#endif
+}
+
+void tar_writer_t::write_header(const std::string &name, size_t size, std::time_t mtime, unsigned mode, char type)
+{
+    ustar_header_t header;
+    std::memset(&header, 0, sizeof(header));
+    // pax extended header carrying what the ustar fields cannot hold, which are then only a fallback for old readers
+    std::string records;
+    if (!split_name(name, header)) {
+        records += pax_record("path", name);
+        std::memcpy(header.name, name.data() + name.size() - sizeof(header.name), sizeof(header.name));
+    }
+    if (size > max_ustar_size) {
+        records += pax_record("size", std::to_string(size));
+    }
+    if (!records.empty()) {
+        write_header("PaxHeaders/" + std::to_string(std::hash<std::string>{}(name)), records.size(), mtime, 0644, 'x');
+        write(records.data(), records.size());
+        pad(records.size());
+    }
+    put_octal(header.mode, sizeof(header.mode), mode & 07777);
+    put_octal(header.uid, sizeof(header.uid), 0);
+    put_octal(header.gid, sizeof(header.gid), 0);
+    put_octal(header.size, sizeof(header.size), size > max_ustar_size ? 0 : size);
+    put_octal(header.mtime, sizeof(header.mtime), mtime < 0 ? 0 : static_cast<unsigned long long>(mtime));
+    header.type = type;
+    std::memcpy(header.magic, "ustar", 6);
+    std::memcpy(header.version, "00", 2);
+
+    std::memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned checksum = 0;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        checksum += reinterpret_cast<const unsigned char *>(&header)[i];
+    }
+    std::snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+    write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void tar_writer_t::pad(size_t size)
+{
+    static const char zeros[block_size] = {};
+    if (size % block_size != 0) {
+        write(zeros, block_size - size % block_size);
+    }
+}
+
+void tar_writer_t::add(const std::string &name, const std::vector<char> &data, std::time_t mtime, unsigned mode)
+{
+    write_header(name, data.size(), mtime, mode, '0');
+    write(data.data(), data.size());
+    pad(data.size());
+}
+
+void tar_writer_t::finish()
+{
+    static const char zeros[2 * block_size] = {};
+    write(zeros, sizeof(zeros), true);
+    file_.close();
+    if (file_.fail()) {
+        throw std::runtime_error("failed to write: " + path_.string());
+    }
+}
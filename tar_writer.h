@@ -0,0 +1,38 @@
+#ifndef TAR_WRITER_H
+#define TAR_WRITER_H
+
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Sequential writer of a POSIX ustar archive, gzip compressed if asked. Names and sizes that do not fit the ustar
+// header are stored in a pax extended header. throws std::runtime_error on I/O or compression errors
+class tar_writer_t
+{
+public:
+    tar_writer_t(const std::filesystem::path &path, bool gzip);
+    ~tar_writer_t();
+
+    // false if this build cannot compress
+    static bool gzip_available();
+
+    // `mode` holds the permission bits of the member
+    void add(const std::string &name, const std::vector<char> &data, std::time_t mtime, unsigned mode = 0644);
+    // write the end-of-archive blocks and flush the compressor
+    void finish();
+
+private:
+    void write(const char *data, size_t size, bool flush = false);
+    void write_header(const std::string &name, size_t size, std::time_t mtime, unsigned mode, char type);
+    void pad(size_t size);
+
+    std::filesystem::path path_;
+    std::ofstream file_;
+    struct deflate_t;
+    std::unique_ptr<deflate_t> deflate_; // nullptr for a plain tar
+};
+
+#endif // TAR_WRITER_H
@@ -0,0 +1,250 @@
+// The native converters against the linked iconv, byte for byte: every byte sequence of each charset decoded to
+// UTF-8 and every code point encoded from UTF-8, one at a time and as a whole text. The text is then converted
+// again through output buffers of a few bytes and input fed in pieces, which has to give the same result.
+// Usage: chconv_native_codec_test CHARSET...
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <iconv.h>
+
+#include "native_codec.h"
+
+namespace
+{
+int failures = 0;
+
+bool check(bool ok, const std::string &charset, const std::string &what, const std::string &input)
+{
+    if (!ok && ++failures <= 50) {
+        std::string hex;
+        for (size_t i = 0; i < input.size() && i < 16; ++i) {
+            char byte[4];
+            std::snprintf(byte, sizeof(byte), "%02X", static_cast<unsigned char>(input[i]));
+            hex += byte;
+        }
+        std::fprintf(stderr, "%s: %s differs for input %s%s (%zu bytes)\n", charset.c_str(), what.c_str(), hex.c_str(), input.size() > 16 ? "..." : "", input.size());
+    }
+    return ok;
+}
+
+struct result_t
+{
+    int error; // 0, EILSEQ or EINVAL
+    size_t consumed;
+    std::string output;
+
+    bool operator==(const result_t &) const = default;
+};
+
+template<typename Convert>
+result_t run(Convert convert, const std::string &input, size_t capacity)
+{
+    std::string output(capacity, '\0');
+    char *in = const_cast<char *>(input.data());
+    size_t in_left = input.size();
+    char *out = output.data();
+    size_t out_left = output.size();
+    const int error = convert(&in, &in_left, &out, &out_left) == static_cast<size_t>(-1) ? errno : 0;
+    output.resize(output.size() - out_left);
+    return {error, input.size() - in_left, output};
+}
+
+// `capacity` bytes of output, by default enough for any conversion
+result_t run_native(native::converter_t &converter, const std::string &input, size_t capacity = 0)
+{
+    return run([&](char **in, size_t *in_left, char **out, size_t *out_left) { return converter.convert(in, in_left, out, out_left); },
+               input,
+               capacity != 0 ? capacity : input.size() * 4 + 16);
+}
+
+result_t run_iconv(iconv_t cd, const std::string &input)
+{
+    iconv(cd, nullptr, nullptr, nullptr, nullptr);
+    return run([&](char **in, size_t *in_left, char **out, size_t *out_left) { return iconv(cd, in, in_left, out, out_left); }, input, input.size() * 4 + 16);
+}
+
+// One character against iconv, also with an output buffer of exactly the size it needs
+void check_character(const std::string &charset, const std::string &what, native::converter_t &converter, const result_t &expected, const std::string &input)
+{
+    if (check(run_native(converter, input) == expected, charset, what, input) && expected.error == 0 && !expected.output.empty()) {
+        check(run_native(converter, input, expected.output.size()) == expected, charset, what + " into an exactly sized buffer", input);
+    }
+}
+
+// `room` bytes of output per call, one more while not even one character fits
+bool run_tiny_output(native::converter_t &converter, const std::string &input, size_t room, std::string &output)
+{
+    char *in = const_cast<char *>(input.data());
+    size_t in_left = input.size();
+    size_t window = room;
+    while (true) {
+        char buffer[16];
+        char *out = buffer;
+        size_t out_left = window;
+        const size_t result = converter.convert(&in, &in_left, &out, &out_left);
+        output.append(buffer, out - buffer);
+        if (result != static_cast<size_t>(-1)) {
+            return in_left == 0;
+        }
+        if (errno != E2BIG || window == sizeof(buffer)) {
+            return false;
+        }
+        window = out == buffer ? window + 1 : room;
+    }
+}
+
+// Input fed `piece` bytes at a time, an incomplete character at the end being kept for the next piece
+bool run_pieces(native::converter_t &converter, const std::string &input, size_t piece, std::string &output)
+{
+    std::string pending;
+    for (size_t pos = 0; pos < input.size(); pos += piece) {
+        pending += input.substr(pos, piece);
+        std::string buffer(pending.size() * 4 + 16, '\0');
+        char *in = pending.data();
+        size_t in_left = pending.size();
+        char *out = buffer.data();
+        size_t out_left = buffer.size();
+        if (converter.convert(&in, &in_left, &out, &out_left) == static_cast<size_t>(-1) && errno != EINVAL) {
+            return false;
+        }
+        output.append(buffer.data(), out - buffer.data());
+        pending.erase(0, pending.size() - in_left);
+    }
+    return pending.empty();
+}
+
+std::string utf8(char32_t cp)
+{
+    std::string s;
+    if (cp < 0x80) {
+        s += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        s += static_cast<char>(0xC0 | (cp >> 6));
+        s += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        s += static_cast<char>(0xE0 | (cp >> 12));
+        s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        s += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        s += static_cast<char>(0xF0 | (cp >> 18));
+        s += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        s += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        s += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+    return s;
+}
+
+struct iconv_guard_t
+{
+    ~iconv_guard_t()
+    {
+        iconv_close(cd);
+    }
+    iconv_t cd;
+};
+
+// Decode every sequence of up to three bytes, extending only those both sides find incomplete.
+// The valid ones are collected into `text`, with runs of ASCII in between.
+void test_decode(const std::string &charset, native::converter_t &converter, iconv_t cd, std::string prefix, std::string &text)
+{
+    for (int b = 0; b < 256; ++b) {
+        const std::string input = prefix + static_cast<char>(b);
+        const result_t expected = run_iconv(cd, input);
+        check_character(charset, "decoding", converter, expected, input);
+        if (expected.error == EINVAL && input.size() < 3) {
+            test_decode(charset, converter, cd, input, text);
+        } else if (expected.error == 0) {
+            text += input;
+            if (text.size() % 7 == 0) {
+                text += " C:\\path\\to [file] ~$@ ";
+            }
+        }
+    }
+}
+
+void test_encode(const std::string &charset, native::converter_t &converter, iconv_t cd)
+{
+    for (char32_t cp = 0; cp <= 0x10FFFF; ++cp) {
+        if (cp >= 0xD800 && cp < 0xE000) {
+            continue;
+        }
+        const std::string input = utf8(cp);
+        check_character(charset, "encoding", converter, run_iconv(cd, input), input);
+    }
+}
+
+// Whole text one-shot against iconv, then through tiny buffers and pieces against the one-shot result
+void test_text(const std::string &charset, const std::string &what, native::converter_t &converter, iconv_t cd, const std::string &text)
+{
+    const result_t expected = run_iconv(cd, text);
+    check(expected.error == 0, charset, what + " of the whole text by iconv", text);
+    check(run_native(converter, text) == expected, charset, what + " of the whole text", text);
+    for (size_t room = 1; room <= 5; ++room) {
+        std::string output;
+        check(run_tiny_output(converter, text, room, output) && output == expected.output, charset, what + " with " + std::to_string(room) + " byte output buffers", text);
+    }
+    for (size_t piece : {1, 2, 3, 5}) {
+        std::string output;
+        check(run_pieces(converter, text, piece, output) && output == expected.output, charset, what + " of " + std::to_string(piece) + " byte input pieces", text);
+    }
+}
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s CHARSET...\n", argv[0]);
+        return 1;
+    }
+    std::string previous;
+    for (int i = 1; i < argc; ++i) {
+        const std::string charset = argv[i];
+        if (native::find_charset(charset) == nullptr) {
+            std::printf("%s: no native tables, skipped\n", charset.c_str());
+            continue;
+        }
+        const auto decoder = native::converter_t::open("UTF-8", charset);
+        const auto encoder = native::converter_t::open(charset, "UTF-8");
+        const iconv_guard_t iconv_decoder{iconv_open("UTF-8", charset.c_str())};
+        const iconv_guard_t iconv_encoder{iconv_open(charset.c_str(), "UTF-8")};
+        if (!decoder || !encoder || iconv_decoder.cd == (iconv_t)-1 || iconv_encoder.cd == (iconv_t)-1) {
+            check(false, charset, "opening", "");
+            continue;
+        }
+        const int before = failures;
+
+        std::string text;
+        test_decode(charset, *decoder, iconv_decoder.cd, "", text);
+        test_encode(charset, *encoder, iconv_encoder.cd);
+        test_text(charset, "decoding", *decoder, iconv_decoder.cd, text);
+        const std::string decoded = run_iconv(iconv_decoder.cd, text).output;
+        test_text(charset, "encoding", *encoder, iconv_encoder.cd, decoded);
+
+        // table to table, with characters missing from the other charset substituted
+        if (!previous.empty()) {
+            const auto direct = native::converter_t::open(previous, charset, native::unmappable_t::substitute);
+            if (check(direct != nullptr, charset, "opening to " + previous, "")) {
+                const result_t expected = run_native(*direct, text);
+                check(expected.error == 0, charset, "conversion to " + previous, text);
+                for (size_t room = 1; room <= 5; ++room) {
+                    std::string output;
+                    check(run_tiny_output(*direct, text, room, output) && output == expected.output, charset, "conversion to " + previous + " with tiny output buffers", text);
+                }
+                for (size_t piece : {1, 2, 3}) {
+                    std::string output;
+                    check(run_pieces(*direct, text, piece, output) && output == expected.output, charset, "conversion to " + previous + " of input pieces", text);
+                }
+            }
+        }
+        previous = charset;
+        std::printf("%s: %s\n", charset.c_str(), failures == before ? "ok" : "FAILED");
+    }
+    if (failures != 0) {
+        std::fprintf(stderr, "%d differences\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+// Every vectorised kernel at every level this CPU supports, compared with the scalar kernel on odd lengths,
+// unaligned starts and stop bytes at each position, which covers the vector lane boundaries of all levels
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "simd.h"
+
+namespace
+{
+int failures = 0;
+
+void check(bool ok, const char *what, const char *level, size_t offset, size_t n, size_t pos)
+{
+    if (!ok && ++failures <= 20) {
+        std::fprintf(stderr, "%s mismatch at %s: offset %zu, length %zu, position %zu\n", what, level, offset, n, pos);
+    }
+}
+
+// starts relative to a 64 byte aligned buffer, around the 16, 32 and 64 byte lanes
+constexpr size_t offsets[] = {0, 1, 2, 3, 5, 7, 8, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65};
+constexpr size_t max_offset = 65;
+constexpr size_t max_length = 200;
+
+void test_ascii_span(const char *level, const simd::kernels_t &scalar)
+{
+    const std::uint8_t exception_sets[][4] = {
+        {0xFF, 0xFF, 0xFF, 0xFF},
+        {0x5C, 0xFF, 0xFF, 0xFF}, // SHIFT_JIS yen sign
+        {0x7E, 0x5C, 0x24, 0x40},
+    };
+    alignas(64) std::uint8_t buffer[max_offset + max_length + 1];
+    for (size_t i = 0; i < sizeof(buffer); ++i) {
+        buffer[i] = static_cast<std::uint8_t>('a' + i % 26);
+    }
+    for (const auto &exceptions : exception_sets) {
+        // stop bytes: none, non-ASCII, and each exception byte
+        std::vector<int> stops = {-1, 0x80, 0xC3, 0xFF};
+        for (const std::uint8_t e : exceptions) {
+            if (e < 0x80) {
+                stops.push_back(e);
+            }
+        }
+        for (const int stop : stops) {
+            for (const size_t offset : offsets) {
+                for (size_t n = 0; n <= max_length; ++n) {
+                    std::uint8_t *const p = buffer + offset;
+                    // bytes past the end must not be looked at
+                    const std::uint8_t after = p[n];
+                    p[n] = 0x80;
+                    for (size_t pos = 0; pos < (stop < 0 ? 1 : n); ++pos) {
+                        const std::uint8_t original = p[pos];
+                        if (stop >= 0) {
+                            p[pos] = static_cast<std::uint8_t>(stop);
+                        }
+                        const size_t expected = scalar.ascii_span(p, n, exceptions);
+                        check(expected == (stop < 0 ? n : pos), "scalar ascii_span", level, offset, n, pos);
+                        check(simd::active->ascii_span(p, n, exceptions) == expected, "ascii_span", level, offset, n, pos);
+                        check(simd::ascii_span(p, n, exceptions) == expected, "inline ascii_span", level, offset, n, pos);
+                        p[pos] = original;
+                    }
+                    p[n] = after;
+                }
+            }
+        }
+    }
+}
+
+void test_count_nuls(const char *level, const simd::kernels_t &scalar)
+{
+    std::vector<std::uint8_t> buffer(max_offset + max_length);
+    std::uint32_t seed = 1;
+    for (int density : {0, 1, 4, 16, 64}) {
+        for (auto &b : buffer) {
+            seed = seed * 1664525 + 1013904223;
+            b = density != 0 && (seed >> 24) % density == 0 ? 0 : static_cast<std::uint8_t>(1 + (seed >> 16) % 255);
+        }
+        for (const size_t offset : offsets) {
+            for (size_t n = 0; n <= max_length; n += 4) {
+                size_t expected[4] = {1, 2, 3, 4};
+                size_t nuls[4] = {1, 2, 3, 4};
+                scalar.count_nuls(buffer.data() + offset, n, expected);
+                simd::active->count_nuls(buffer.data() + offset, n, nuls);
+                check(std::memcmp(nuls, expected, sizeof(nuls)) == 0, "count_nuls", level, offset, n, density);
+            }
+        }
+    }
+}
+}
+
+int main()
+{
+    simd::select("scalar");
+    const simd::kernels_t scalar = *simd::active;
+    int tested = 0;
+    for (const char *level : {"scalar", "sse4.2", "avx2", "avx512"}) {
+        try {
+            simd::select(level);
+        } catch (const std::invalid_argument &) {
+            std::printf("%s: not supported by this CPU, skipped\n", level);
+            continue;
+        }
+        test_ascii_span(level, scalar);
+        test_count_nuls(level, scalar);
+        std::printf("%s: tested\n", level);
+        ++tested;
+    }
+    if (failures != 0) {
+        std::fprintf(stderr, "%d mismatches\n", failures);
+        return 1;
+    }
+    return tested > 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#include "transcoding_reader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+constexpr char index_magic[8] = {'C', 'H', 'C', 'V', 'I', 'D', 'X', '1'};
+
+std::string upper(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+    return str;
+}
+
+void put_u64(std::vector<char> &out, std::uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+std::uint64_t get_u64(const char *in)
+{
+    std::uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+}
+
+// Convert all of `input`, keeping an incomplete trailing character in it unless `last`. false with errno set on error.
+bool convert_chunk(conversion_t &conversion, std::vector<char> &input, std::vector<char> &output, bool last)
+{
+    output.resize(std::max<size_t>(input.size() << 1, 16));
+    char *in_ptr = input.data();
+    size_t in_left = input.size();
+    size_t produced = 0;
+    while (true) {
+        char *out_ptr = output.data() + produced;
+        size_t out_left = output.size() - produced;
+        const size_t result = conversion.convert(&in_ptr, &in_left, &out_ptr, &out_left);
+        produced = output.size() - out_left;
+        if (result != static_cast<size_t>(-1)) {
+            break;
+        }
+        if (errno == E2BIG) {
+            output.resize(output.size() << 1);
+        } else if (errno == EINVAL && !last) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    output.resize(produced);
+    input.erase(input.begin(), input.begin() + (in_ptr - input.data()));
+    return true;
+}
+}
+
+transcoding_reader_t::transcoding_reader_t(backend_selector_t &backends,
+                                           const fs::path &path,
+                                           const std::string &from_encoding,
+                                           const std::string &to_encoding,
+                                           native::unmappable_t unmappable,
+                                           size_t interval)
+    : backends_(backends)
+    , path_(path)
+    , from_encoding_(from_encoding)
+    , to_encoding_(to_encoding)
+    , unmappable_(unmappable)
+    , file_size_(fs::file_size(path))
+    , file_mtime_(fs::last_write_time(path).time_since_epoch().count())
+{
+    const std::string from = upper(from_encoding);
+    const std::string to = upper(to_encoding);
+    for (const char *stateful : {"ISO-2022", "HZ", "UTF-7"}) {
+        if (from.starts_with(stateful)) {
+            throw std::invalid_argument(from_encoding + " has shift states and cannot be read from an arbitrary offset");
+        }
+        // the text converted from a checkpoint on would start in the initial state, not the one reached there
+        if (to.starts_with(stateful)) {
+            throw std::invalid_argument("output encoding " + to_encoding + " has shift states and cannot be written from an arbitrary offset");
+        }
+    }
+    // every restarted conversion would emit another byte order mark
+    if (to == "UTF-16" || to == "UTF-32") {
+        throw std::invalid_argument("output encoding " + to_encoding + " needs an explicit byte order (LE or BE) for random access");
+    }
+    if (!load_index()) {
+        build_index(std::max<size_t>(interval, 4096));
+    }
+}
+
+fs::path transcoding_reader_t::index_path(const fs::path &path)
+{
+    fs::path index = path;
+    index += ".chconv-index";
+    return index;
+}
+
+std::string transcoding_reader_t::identity() const
+{
+    return from_encoding_ + '\n' + to_encoding_ + '\n' + std::to_string(static_cast<int>(unmappable_));
+}
+
+std::unique_ptr<conversion_t> transcoding_reader_t::open_conversion(std::uint64_t input_offset, const std::vector<char> &sample)
+{
+    std::string from = from_encoding_;
+    // past the start the byte order mark is gone, so the order it announced has to be named explicitly
+    if (const std::string name = upper(from); input_offset > 0 && (name == "UTF-16" || name == "UTF-32")) {
+        char bom[2] = {};
+        std::ifstream(path_, std::ios::binary).read(bom, sizeof(bom));
+        from = name + (bom[0] == '\xFF' && bom[1] == '\xFE' ? "LE" : "BE");
+    }
+    auto conversion = backends_.open(to_encoding_, from, unmappable_, sample);
+    if (!conversion) {
+        throw std::runtime_error("cannot convert " + path_.string() + " (" + from + ") to " + to_encoding_);
+    }
+    return conversion;
+}
+
+void transcoding_reader_t::build_index(size_t interval)
+{
+    std::ifstream file(path_, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("cannot open file: " + path_.string());
+    }
+    std::vector<char> input;
+    std::vector<char> output;
+    std::vector<char> chunk(interval);
+    std::unique_ptr<conversion_t> conversion;
+    std::uint64_t consumed = 0;
+    std::uint64_t produced = 0;
+    checkpoints_.assign(1, {0, 0});
+    while (consumed < file_size_) {
+        file.read(chunk.data(), chunk.size());
+        const size_t n = file.gcount();
+        if (n == 0) {
+            throw std::runtime_error("failed to read: " + path_.string());
+        }
+        input.insert(input.end(), chunk.begin(), chunk.begin() + n);
+        if (!conversion) {
+            conversion = open_conversion(0, input);
+        }
+        const size_t before = input.size();
+        const bool last = consumed + before >= file_size_;
+        if (!convert_chunk(*conversion, input, output, last)) {
+            throw std::runtime_error("convert " + path_.string() + " failed near offset " + std::to_string(consumed) + ": " + std::strerror(errno));
+        }
+        // the converter stopped after a complete character, so the text can be restarted here
+        consumed += before - input.size();
+        produced += output.size();
+        checkpoints_.push_back({consumed, produced});
+        if (last) {
+            break;
+        }
+    }
+    loaded_ = false;
+}
+
+bool transcoding_reader_t::load_index()
+{
+    std::ifstream file(index_path(path_), std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::vector<char> data(file.tellg());
+    file.seekg(0);
+    if (!file.read(data.data(), data.size()) || data.size() < sizeof(index_magic) + 32 || std::memcmp(data.data(), index_magic, sizeof(index_magic)) != 0) {
+        return false;
+    }
+    // magic, file size, file mtime, identity length, identity, checkpoint count, checkpoints
+    const char *p = data.data() + sizeof(index_magic);
+    const char *const end = data.data() + data.size();
+    if (get_u64(p) != file_size_ || static_cast<std::int64_t>(get_u64(p + 8)) != file_mtime_) {
+        return false;
+    }
+    const std::uint64_t identity_size = get_u64(p + 16);
+    p += 24;
+    const std::string expected = identity();
+    if (identity_size != expected.size() || static_cast<size_t>(end - p) < identity_size + 8 || expected.compare(0, std::string::npos, p, identity_size) != 0) {
+        return false;
+    }
+    p += identity_size;
+    const std::uint64_t count = get_u64(p);
+    p += 8;
+    if (count < 1 || static_cast<std::uint64_t>(end - p) != count * 16) {
+        return false;
+    }
+    std::vector<checkpoint_t> checkpoints(count);
+    for (auto &checkpoint : checkpoints) {
+        checkpoint = {get_u64(p), get_u64(p + 8)};
+        p += 16;
+    }
+    if (checkpoints.front().input != 0 || checkpoints.back().input != file_size_) {
+        return false;
+    }
+    checkpoints_ = std::move(checkpoints);
+    loaded_ = true;
+    return true;
+}
+
+void transcoding_reader_t::save_index() const
+{
+    std::vector<char> data(index_magic, index_magic + sizeof(index_magic));
+    const std::string id = identity();
+    put_u64(data, file_size_);
+    put_u64(data, static_cast<std::uint64_t>(file_mtime_));
+    put_u64(data, id.size());
+    data.insert(data.end(), id.begin(), id.end());
+    put_u64(data, checkpoints_.size());
+    for (const auto &checkpoint : checkpoints_) {
+        put_u64(data, checkpoint.input);
+        put_u64(data, checkpoint.output);
+    }
+    // written aside and renamed, so that a concurrent reader never sees a partial index
+    fs::path temporary = index_path(path_);
+    temporary += ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    if (!file.write(data.data(), data.size()) || (file.close(), file.fail())) {
+        throw std::runtime_error("failed to write: " + temporary.string());
+    }
+    fs::rename(temporary, index_path(path_));
+}
+
+std::vector<char> transcoding_reader_t::read(std::uint64_t offset, size_t length)
+{
+    std::vector<char> result;
+    if (offset >= size() || length == 0) {
+        return result;
+    }
+    const std::uint64_t end = std::min<std::uint64_t>(size(), offset + length);
+    // last checkpoint at or before the requested offset
+    auto it = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), offset, [](std::uint64_t value, const checkpoint_t &checkpoint) {
+                  return value < checkpoint.output;
+              }) - 1;
+
+    std::ifstream file(path_, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("cannot open file: " + path_.string());
+    }
+    std::unique_ptr<conversion_t> conversion;
+    std::vector<char> input;
+    std::vector<char> output;
+    for (; it + 1 != checkpoints_.end() && it->output < end; ++it) {
+        const auto next = it + 1;
+        input.resize(next->input - it->input);
+        file.seekg(static_cast<std::streamoff>(it->input));
+        if (!file.read(input.data(), input.size())) {
+            throw std::runtime_error("failed to read: " + path_.string());
+        }
+        if (!conversion) {
+            conversion = open_conversion(it->input, input);
+        }
+        if (!convert_chunk(*conversion, input, output, true) || output.size() != next->output - it->output) {
+            throw std::runtime_error(path_.string() + " no longer matches its index");
+        }
+        const std::uint64_t from = std::max(offset, it->output) - it->output;
+        const std::uint64_t to = std::min(end, next->output) - it->output;
+        result.insert(result.end(), output.begin() + from, output.begin() + to);
+    }
+    return result;
+}
@@ -0,0 +1,71 @@
+#ifndef TRANSCODING_READER_H
+#define TRANSCODING_READER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+
+// Random access to the converted text of a file without converting it whole. A sparse index of
+// (input offset, output offset) checkpoints at character boundaries is built by one streaming pass, after which
+// a read only converts the input between the checkpoints around the requested output range.
+// The index can be saved next to the file and is reused by later readers as long as the file is unchanged.
+// Encodings with shift states (ISO-2022-*, HZ, UTF-7) cannot be restarted at a checkpoint and are rejected on either
+// side, as are outputs with a byte order mark. Charset declarations are left as they are, unlike in converted files.
+class transcoding_reader_t
+{
+public:
+    // `from_encoding` is the detected encoding of `path`; throws std::runtime_error if the file cannot be read or
+    // converted, std::invalid_argument for an encoding with shift states
+    transcoding_reader_t(backend_selector_t &backends,
+                         const std::filesystem::path &path,
+                         const std::string &from_encoding,
+                         const std::string &to_encoding,
+                         native::unmappable_t unmappable = native::unmappable_t::fail,
+                         size_t interval = 1024 * 1024);
+
+    // Size of the whole converted text
+    std::uint64_t size() const
+    {
+        return checkpoints_.back().output;
+    }
+    // Whether the index was loaded from disk instead of being built
+    bool index_loaded() const
+    {
+        return loaded_;
+    }
+
+    // Converted bytes [offset, offset + length), shorter at the end of the text; throws std::runtime_error
+    std::vector<char> read(std::uint64_t offset, size_t length);
+
+    // Persist the index to index_path(); throws std::runtime_error
+    void save_index() const;
+    static std::filesystem::path index_path(const std::filesystem::path &path);
+
+private:
+    struct checkpoint_t
+    {
+        std::uint64_t input;
+        std::uint64_t output;
+    };
+
+    void build_index(size_t interval);
+    bool load_index();
+    std::unique_ptr<conversion_t> open_conversion(std::uint64_t input_offset, const std::vector<char> &sample);
+    std::string identity() const;
+
+    backend_selector_t &backends_;
+    std::filesystem::path path_;
+    std::string from_encoding_;
+    std::string to_encoding_;
+    native::unmappable_t unmappable_;
+    std::uint64_t file_size_;
+    std::int64_t file_mtime_;
+    std::vector<checkpoint_t> checkpoints_; // ascending, from (0, 0) to (file size, converted size)
+    bool loaded_ = false;
+};
+
+#endif // TRANSCODING_READER_H